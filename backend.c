@@ -31,18 +31,47 @@
 #include <string.h>
 #include <limits.h>
 #include <dlfcn.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "backend.h"
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof((a)[0]))
 
-/* a more clever scheme would be to discover backends in a certain
- * directory..
- */
+#define MAX_BACKENDS 16
+#define MAX_DRIVERS 16
+
+/* used when MODULEDIR has nothing that looks like a backend */
 static const char *backends[] = {
       "libgbm_kms.so.1",
 };
 
+/*
+ * Backends found in MODULEDIR. They are loaded on first use and stay
+ * loaded, so that opening further devices doesn't go through the dynamic
+ * linker again.
+ */
+struct backend_module {
+   char name[NAME_MAX + 1];   /* file name, or path if it has a '/' */
+   char stem[NAME_MAX + 1];   /* "kms" for libgbm_kms.so.1 */
+   int loaded;
+   const struct gbm_backend *backend;
+};
+
+/* Which backend last served a DRM driver */
+struct backend_driver {
+   char name[32];
+   struct backend_module *module;
+};
+
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static int backends_scanned;
+static struct backend_module modules[MAX_BACKENDS];
+static int num_modules;
+static struct backend_module env_module;
+static struct backend_driver drivers[MAX_DRIVERS];
+static int num_drivers;
+
 static const void *
 load_backend(const char *name)
 {
@@ -64,28 +93,195 @@ load_backend(const char *name)
    return dlsym(module, entrypoint);
 }
 
+static const struct gbm_backend *
+module_get_backend(struct backend_module *module)
+{
+   if (!module->loaded) {
+      module->loaded = 1;
+      module->backend = load_backend(module->name);
+      if (module->backend)
+         fprintf(stderr, "loaded module: %s\n", module->name);
+   }
+
+   return module->backend;
+}
+
+static void
+add_module(const char *name, const char *stem, size_t stem_len)
+{
+   struct backend_module *module;
+   int i;
+
+   if (stem_len > NAME_MAX)
+      return;
+
+   /* libgbm_kms.so and libgbm_kms.so.1 are the same backend */
+   for (i = 0; i < num_modules; i++) {
+      module = &modules[i];
+      if (strlen(module->stem) == stem_len &&
+          !strncmp(module->stem, stem, stem_len)) {
+         if (strlen(name) < strlen(module->name))
+            snprintf(module->name, sizeof module->name, "%s", name);
+         return;
+      }
+   }
+
+   if (num_modules == MAX_BACKENDS)
+      return;
+
+   module = &modules[num_modules++];
+   snprintf(module->name, sizeof module->name, "%s", name);
+   memcpy(module->stem, stem, stem_len);
+   module->stem[stem_len] = '\0';
+}
+
+static void
+scan_backends(void)
+{
+   const char *prefix = "libgbm_";
+   struct dirent *entry;
+   unsigned i;
+   DIR *dir;
+
+   backends_scanned = 1;
+
+   if ((dir = opendir(MODULEDIR))) {
+      while ((entry = readdir(dir))) {
+         const char *stem, *so;
+
+         if (strncmp(entry->d_name, prefix, strlen(prefix)))
+            continue;
+
+         stem = entry->d_name + strlen(prefix);
+         so = strstr(stem, ".so");
+         if (!so || so == stem || (so[3] != '\0' && so[3] != '.'))
+            continue;
+
+         add_module(entry->d_name, stem, so - stem);
+      }
+      closedir(dir);
+   }
+
+   if (num_modules)
+      return;
+
+   for (i = 0; i < ARRAY_SIZE(backends); i++) {
+      const char *stem = backends[i] + strlen(prefix);
+
+      add_module(backends[i], stem, strcspn(stem, "."));
+   }
+}
+
+static struct backend_module *
+find_driver(const char *driver)
+{
+   int i;
+
+   for (i = 0; i < num_drivers; i++) {
+      if (!strcmp(drivers[i].name, driver))
+         return drivers[i].module;
+   }
+
+   return NULL;
+}
+
+static void
+remember_driver(const char *driver, struct backend_module *module)
+{
+   int i;
+
+   if (!driver[0])
+      return;
+
+   for (i = 0; i < num_drivers; i++) {
+      if (!strcmp(drivers[i].name, driver)) {
+         drivers[i].module = module;
+         return;
+      }
+   }
+
+   if (num_drivers == MAX_DRIVERS)
+      return;
+
+   snprintf(drivers[num_drivers].name, sizeof drivers[0].name, "%s", driver);
+   drivers[num_drivers++].module = module;
+}
+
+static struct gbm_device *
+try_module(struct backend_module *module, int fd)
+{
+   const struct gbm_backend *backend;
+
+   pthread_mutex_lock(&backend_lock);
+   backend = module_get_backend(module);
+   pthread_mutex_unlock(&backend_lock);
+
+   return backend ? backend->create_device(fd) : NULL;
+}
+
+/* Append module to order, unless it is in there already */
+static void
+queue_module(struct backend_module **order, int *n,
+             struct backend_module *module)
+{
+   int i;
+
+   for (i = 0; i < *n; i++) {
+      if (order[i] == module)
+         return;
+   }
+
+   order[(*n)++] = module;
+}
+
+/*
+ * Try, in this order: the backend named by GBM_BACKEND, the backend that
+ * served the same driver before, the backend named after the driver
+ * (libgbm_<driver>.so), and then all the others. driver may be empty.
+ */
 struct gbm_device *
-_gbm_create_device(int fd)
+_gbm_create_device(int fd, const char *driver)
 {
-   const struct gbm_backend *backend = NULL;
+   /* each module once: GBM_BACKEND's, and all of modules[] */
+   struct backend_module *order[MAX_BACKENDS + 1];
    struct gbm_device *dev = NULL;
-   int i;
    const char *b;
+   int i, n = 0;
+
+   pthread_mutex_lock(&backend_lock);
+
+   if (!backends_scanned)
+      scan_backends();
 
    b = getenv("GBM_BACKEND");
+   if (b && strcmp(env_module.name, b)) {
+      snprintf(env_module.name, sizeof env_module.name, "%s", b);
+      env_module.loaded = 0;
+   }
    if (b)
-      backend = load_backend(b);
+      order[n++] = &env_module;
 
-   if (backend)
-      dev = backend->create_device(fd);
+   if (driver[0] && find_driver(driver))
+      queue_module(order, &n, find_driver(driver));
 
-   for (i = 0; i < ARRAY_SIZE(backends) && dev == NULL; ++i) {
-      backend = load_backend(backends[i]);
-      if (backend == NULL)
-         continue;
-      fprintf(stderr, "loaded module: %s\n", backends[i]);
-      dev = backend->create_device(fd);
+   for (i = 0; driver[0] && i < num_modules; i++) {
+      if (!strcmp(modules[i].stem, driver))
+         queue_module(order, &n, &modules[i]);
    }
-   
+
+   for (i = 0; i < num_modules; i++)
+      queue_module(order, &n, &modules[i]);
+
+   pthread_mutex_unlock(&backend_lock);
+
+   for (i = 0; i < n && dev == NULL; i++) {
+      dev = try_module(order[i], fd);
+      if (dev && order[i] != &env_module) {
+         pthread_mutex_lock(&backend_lock);
+         remember_driver(driver, order[i]);
+         pthread_mutex_unlock(&backend_lock);
+      }
+   }
+
    return dev;
 }
@@ -31,6 +31,6 @@
 #include "gbmint.h"
 
 struct gbm_device *
-_gbm_create_device(int fd);
+_gbm_create_device(int fd, const char *driver);
 
 #endif
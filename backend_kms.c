@@ -25,28 +25,43 @@
  *    Takanari Hayama <taki@igel.co.jp>
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
 
 #include <xf86drm.h>
-#include <libkms.h>
+#include <xf86drmMode.h>
 #include <errno.h>
 #include <drm_fourcc.h>
+#include <linux/dma-buf.h>
+#include <linux/sync_file.h>
+#include <poll.h>
 
 #include <wayland-kms.h>
 
 #include "gbmint.h"
 #include "gbm_kmsint.h"
+#include "common.h"
+#include "kms_copy.h"
 
 #if defined(DEBUG)
 #  define GBM_DEBUG(s, x...)	{ printf(s, ## x); }
@@ -58,33 +73,499 @@
 #define DRM_FORMAT_MOD_INVALID	((1ULL<<56) - 1)
 #endif
 
+#define GBM_KMS_STAT_INC(dev, name) \
+	__atomic_fetch_add(&(dev)->stats.name, 1, __ATOMIC_RELAXED)
+
+#define GBM_KMS_BO_CACHE_MAX_COUNT	16
+#define GBM_KMS_BO_CACHE_MAX_SIZE	(64 * 1024 * 1024)
+#define GBM_KMS_BO_CACHE_MAX_AGE	3000
+
+// the usage flags a cached BO has to match
+#define GBM_KMS_BO_CACHE_USAGE \
+	(GBM_BO_USE_SCANOUT | GBM_BO_USE_CURSOR | GBM_BO_USE_RENDERING | \
+	 GBM_BO_USE_WRITE | GBM_BO_USE_LINEAR)
+
+static void gbm_kms_bo_free(struct gbm_kms_bo *bo);
+static struct gbm_kms_bo *gbm_kms_arena_release(struct gbm_kms_bo *bo);
+static int gbm_kms_bo_export_plane_locked(struct gbm_kms_bo *bo, int plane);
+static void gbm_kms_bo_cache_flush(struct gbm_kms_bo_cache *cache);
+
+static unsigned long gbm_kms_getenv_ulong(const char *name,
+					  unsigned long defval)
+{
+	const char *str = getenv(name);
+	char *end;
+	unsigned long val;
+
+	if (!str || !*str)
+		return defval;
+
+	errno = 0;
+	val = strtoul(str, &end, 0);
+	if (errno || *end)
+		return defval;
+
+	return val;
+}
+
+static uint64_t gbm_kms_get_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Slab of cache line aligned objects
+ */
+struct gbm_kms_slab_chunk {
+	struct wl_list link;
+};
+
+#define GBM_KMS_SLAB_HEADER \
+	((sizeof(struct gbm_kms_slab_chunk) + GBM_KMS_CACHELINE - 1) & \
+	 ~(size_t)(GBM_KMS_CACHELINE - 1))
+
+static void gbm_kms_slab_init(struct gbm_kms_slab *slab, size_t size)
+{
+	pthread_mutex_init(&slab->lock, NULL);
+	slab->slot_size = (size + GBM_KMS_CACHELINE - 1) &
+		~(size_t)(GBM_KMS_CACHELINE - 1);
+	slab->free_list = NULL;
+	wl_list_init(&slab->chunks);
+}
+
+static void gbm_kms_slab_fini(struct gbm_kms_slab *slab)
+{
+	struct gbm_kms_slab_chunk *chunk, *tmp;
+
+	wl_list_for_each_safe(chunk, tmp, &slab->chunks, link)
+		free(chunk);
+	pthread_mutex_destroy(&slab->lock);
+}
+
+static int gbm_kms_slab_grow(struct gbm_kms_slab *slab)
+{
+	struct gbm_kms_slab_chunk *chunk;
+	size_t size = GBM_KMS_SLAB_CHUNK;
+	char *slot;
+
+	// objects larger than a chunk still get a few slots per chunk
+	if (size < GBM_KMS_SLAB_HEADER + 4 * slab->slot_size)
+		size = GBM_KMS_SLAB_HEADER + 4 * slab->slot_size;
+
+	if (posix_memalign((void**)&chunk, GBM_KMS_CACHELINE, size))
+		return -1;
+	wl_list_insert(&slab->chunks, &chunk->link);
+
+	for (slot = (char*)chunk + GBM_KMS_SLAB_HEADER;
+	     slot + slab->slot_size <= (char*)chunk + size;
+	     slot += slab->slot_size) {
+		*(void**)slot = slab->free_list;
+		slab->free_list = slot;
+	}
+
+	return 0;
+}
+
+static void *gbm_kms_slab_alloc(struct gbm_kms_slab *slab)
+{
+	void *obj = NULL;
+
+	pthread_mutex_lock(&slab->lock);
+	if (slab->free_list || !gbm_kms_slab_grow(slab)) {
+		obj = slab->free_list;
+		slab->free_list = *(void**)obj;
+	}
+	pthread_mutex_unlock(&slab->lock);
+
+	if (!obj) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(obj, 0, slab->slot_size);
+	return obj;
+}
+
+static void gbm_kms_slab_free(struct gbm_kms_slab *slab, void *obj)
+{
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&slab->lock);
+	*(void**)obj = slab->free_list;
+	slab->free_list = obj;
+	pthread_mutex_unlock(&slab->lock);
+}
+
+/*
+ * Statistics
+ */
+static struct gbm_kms_format_stats *
+gbm_kms_stats_format_locked(struct gbm_kms_stats *stats, uint32_t format)
+{
+	int i;
+
+	for (i = 0; i < stats->num_formats; i++) {
+		if (stats->formats[i].format == format)
+			return &stats->formats[i];
+	}
+
+	if (stats->num_formats == GBM_KMS_STATS_MAX_FORMATS)
+		return NULL;
+
+	stats->formats[i].format = format;
+	stats->num_formats++;
+	return &stats->formats[i];
+}
+
+/*
+ * Add the BO to, or remove it from, the live totals.
+ */
+static void gbm_kms_stats_account(struct gbm_kms_bo *bo, bool live)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_stats *stats = &dev->stats;
+	struct gbm_kms_format_stats *fmt;
+
+	if (bo->accounted == live)
+		return;
+	bo->accounted = live;
+
+	pthread_mutex_lock(&stats->lock);
+	fmt = gbm_kms_stats_format_locked(stats, bo->base.format);
+	if (live) {
+		stats->live_bos++;
+		stats->live_bytes += bo->size;
+		if (fmt) {
+			fmt->live_bos++;
+			fmt->live_bytes += bo->size;
+		}
+	} else {
+		stats->live_bos--;
+		stats->live_bytes -= bo->size;
+		if (fmt) {
+			fmt->live_bos--;
+			fmt->live_bytes -= bo->size;
+		}
+	}
+	pthread_mutex_unlock(&stats->lock);
+}
+
+#define GBM_KMS_STAT_GET(dev, name) \
+	__atomic_load_n(&(dev)->stats.name, __ATOMIC_RELAXED)
+
+static int gbm_kms_get_stats(struct gbm_device *gbm,
+			     struct gbm_device_stats *out)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+
+	pthread_mutex_lock(&dev->stats.lock);
+	out->live_bos = dev->stats.live_bos;
+	out->live_bytes = dev->stats.live_bytes;
+	pthread_mutex_unlock(&dev->stats.lock);
+
+	out->bo_created = GBM_KMS_STAT_GET(dev, bo_created);
+	out->bo_imported = GBM_KMS_STAT_GET(dev, bo_imported);
+	out->bo_destroyed = GBM_KMS_STAT_GET(dev, bo_destroyed);
+	out->prime_exports = GBM_KMS_STAT_GET(dev, prime_exports);
+	out->prime_imports = GBM_KMS_STAT_GET(dev, prime_imports);
+	out->maps = GBM_KMS_STAT_GET(dev, maps);
+	out->unmaps = GBM_KMS_STAT_GET(dev, unmaps);
+	out->mmaps = GBM_KMS_STAT_GET(dev, mmaps);
+	out->mmaps_avoided = GBM_KMS_STAT_GET(dev, mmaps_avoided);
+	out->cache_hits = GBM_KMS_STAT_GET(dev, cache_hits);
+	out->cache_misses = GBM_KMS_STAT_GET(dev, cache_misses);
+
+	pthread_mutex_lock(&dev->cache.lock);
+	out->cached_bytes = dev->cache.size;
+	out->cache_evictions = dev->cache.evictions;
+	pthread_mutex_unlock(&dev->cache.lock);
+
+	return 0;
+}
+
+static int gbm_kms_get_format_stats(struct gbm_device *gbm,
+				    struct gbm_format_stats *formats,
+				    unsigned int count)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	int i, n = 0;
+
+	pthread_mutex_lock(&dev->stats.lock);
+	for (i = 0; i < dev->stats.num_formats; i++) {
+		struct gbm_kms_format_stats *fmt = &dev->stats.formats[i];
+
+		// formats seen before but with nothing left
+		if (!fmt->live_bos)
+			continue;
+
+		if ((unsigned int)n < count) {
+			formats[n].format = fmt->format;
+			formats[n].live_bos = fmt->live_bos;
+			formats[n].live_bytes = fmt->live_bytes;
+		}
+		n++;
+	}
+	pthread_mutex_unlock(&dev->stats.lock);
+
+	return n;
+}
+
+/*
+ * BO tracking
+ *
+ * With GBM_KMS_TRACK_BOS set, every BO carries a record of who it was
+ * handed out to and when. gbm_device_dump_bos() lists the BOs the user
+ * holds, and destroying the device lists whatever is left. Otherwise the
+ * record stays NULL and the only cost is testing for it.
+ */
+static void gbm_kms_registry_init(struct gbm_kms_registry *registry)
+{
+	registry->enabled = gbm_kms_getenv_ulong("GBM_KMS_TRACK_BOS", 0);
+	pthread_mutex_init(&registry->lock, NULL);
+	wl_list_init(&registry->records);
+}
+
+static void gbm_kms_registry_fini(struct gbm_kms_registry *registry)
+{
+	struct gbm_kms_bo_record *record, *tmp;
+
+	// the BOs are leaked, their wrappers go with the slab
+	wl_list_for_each_safe(record, tmp, &registry->records, link)
+		free(record);
+	pthread_mutex_destroy(&registry->lock);
+}
+
+static int gbm_kms_backtrace(void **frames)
+{
+#ifdef HAVE_EXECINFO_H
+	return backtrace(frames, GBM_KMS_TRACK_FRAMES);
+#else
+	return 0;
+#endif
+}
+
+static void gbm_kms_backtrace_dump(void **frames, int num_frames, int fd)
+{
+#ifdef HAVE_EXECINFO_H
+	backtrace_symbols_fd(frames, num_frames, fd);
+#endif
+}
+
+/*
+ * The user holds the BO from now on. Called for new BOs, and for BOs the
+ * cache or the cursor pool hands out again.
+ */
+static void gbm_kms_bo_track_hold(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_bo_record *record = bo->record;
+	void *frames[GBM_KMS_TRACK_FRAMES];
+	int n;
+
+	if (!record)
+		return;
+
+	n = gbm_kms_backtrace(frames);
+
+	pthread_mutex_lock(&dev->registry.lock);
+	memcpy(record->frames, frames, n * sizeof(void*));
+	record->num_frames = n;
+	record->held_since = gbm_kms_get_time_ms();
+	record->held = true;
+	pthread_mutex_unlock(&dev->registry.lock);
+}
+
+/*
+ * The BO goes back to the backend, to be cached, pooled or freed. Returns
+ * false if the user didn't hold it.
+ */
+static bool gbm_kms_bo_track_drop(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	bool held;
+
+	pthread_mutex_lock(&dev->registry.lock);
+	held = bo->record->held;
+	bo->record->held = false;
+	pthread_mutex_unlock(&dev->registry.lock);
+
+	return held;
+}
+
+static void gbm_kms_bo_track_new(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_bo_record *record;
+
+	// an untracked BO is never reported, but works all the same
+	if (!(record = calloc(1, sizeof(struct gbm_kms_bo_record))))
+		return;
+	record->bo = bo;
+	bo->record = record;
+
+	pthread_mutex_lock(&dev->registry.lock);
+	wl_list_insert(&dev->registry.records, &record->link);
+	pthread_mutex_unlock(&dev->registry.lock);
+
+	gbm_kms_bo_track_hold(bo);
+}
+
+static void gbm_kms_bo_track_delete(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+
+	pthread_mutex_lock(&dev->registry.lock);
+	wl_list_remove(&bo->record->link);
+	pthread_mutex_unlock(&dev->registry.lock);
+
+	free(bo->record);
+	bo->record = NULL;
+}
+
+/*
+ * How gbm_kms_bo_free() gets rid of the buffer.
+ */
+static const char *gbm_kms_bo_owner(const struct gbm_kms_bo *bo)
+{
+	if (bo->arena)
+		return "suballocated";
+	if (bo->pooled)
+		return "cursor pool";
+	if (bo->allocated)
+		return "dumb buffer";
+	if (bo->wl_bound)
+		return "wl_buffer";
+	if (bo->allocated_handle)
+		return "imported";
+	return "borrowed";
+}
+
+static unsigned int gbm_kms_registry_held(struct gbm_kms_registry *registry)
+{
+	struct gbm_kms_bo_record *record;
+	unsigned int n = 0;
+
+	pthread_mutex_lock(&registry->lock);
+	wl_list_for_each(record, &registry->records, link)
+		n += record->held;
+	pthread_mutex_unlock(&registry->lock);
+
+	return n;
+}
+
+static int gbm_kms_dump_bos(struct gbm_device *gbm, int fd)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	struct gbm_kms_registry *registry = &dev->registry;
+	struct gbm_kms_bo_record *record;
+	struct gbm_format_name_desc name;
+	unsigned long long bytes = 0;
+	uint64_t now;
+	int n = 0;
+
+	if (!registry->enabled) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	now = gbm_kms_get_time_ms();
+
+	pthread_mutex_lock(&registry->lock);
+	wl_list_for_each_reverse(record, &registry->records, link) {
+		struct gbm_kms_bo *bo = record->bo;
+
+		if (!record->held)
+			continue;
+
+		dprintf(fd, "gbm: BO %p: %ux%u %s, %u bytes, %s, handle %u, "
+			"held for %llu ms\n", (void*)bo,
+			bo->base.width, bo->base.height,
+			gbm_format_get_name(bo->base.format, &name), bo->size,
+			gbm_kms_bo_owner(bo), bo->base.handle.u32,
+			(unsigned long long)(now - record->held_since));
+		gbm_kms_backtrace_dump(record->frames, record->num_frames, fd);
+
+		bytes += bo->size;
+		n++;
+	}
+	pthread_mutex_unlock(&registry->lock);
+
+	dprintf(fd, "gbm: %d BOs held, %llu bytes\n", n, bytes);
+
+	return n;
+}
+
 /*
  * Destroy gbm backend
  */
+static void gbm_kms_wl_buffers_unbind(struct gbm_kms_device *dev);
+static void gbm_kms_cursor_pool_fini(struct gbm_kms_cursor_pool *pool);
+static void gbm_kms_suballoc_fini(struct gbm_kms_suballocator *suballoc);
+static void gbm_kms_upload_pool_fini(struct gbm_kms_upload_pool *pool);
+static void gbm_kms_pressure_fini(struct gbm_kms_pressure *pressure);
+
 static void gbm_kms_destroy(struct gbm_device *gbm)
 {
-	free(gbm);
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+
+	gbm_kms_pressure_fini(&dev->pressure);
+	gbm_kms_upload_pool_fini(&dev->upload);
+	gbm_kms_wl_buffers_unbind(dev);
+	gbm_kms_cursor_pool_fini(&dev->cursor);
+	gbm_kms_suballoc_fini(&dev->suballoc);
+	gbm_kms_bo_cache_flush(&dev->cache);
+
+	// whatever the user still holds now has leaked
+	if (gbm_kms_registry_held(&dev->registry))
+		gbm_kms_dump_bos(gbm, STDERR_FILENO);
+	gbm_kms_registry_fini(&dev->registry);
+
+	pthread_mutex_destroy(&dev->cache.lock);
+	pthread_mutex_destroy(&dev->modifiers_lock);
+	pthread_mutex_destroy(&dev->stats.lock);
+	pthread_mutex_destroy(&dev->cursor.lock);
+	gbm_kms_slab_fini(&dev->bo_slab);
+	gbm_kms_slab_fini(&dev->surface_slab);
+	if (dev->alloc_fd != dev->base.fd)
+		close(dev->alloc_fd);
+	free(dev->modifiers);
+	free(dev);
+}
+
+/*
+ * The layout of a format we can allocate, or NULL. All planes of a BO
+ * are carved out of a single dumb buffer, one after another.
+ */
+static const struct gbm_format_desc *gbm_kms_get_format(uint32_t format)
+{
+	const struct gbm_format_desc *info = _gbm_format_get_desc(format);
+
+	// dumb buffers are sized in whole bytes per pixel
+	if (!info || !info->cpp[0])
+		return NULL;
+
+	return info;
 }
 
 /*
  * Get number of plans of supported format.
  * Returns -1 and set EINVAL to errno, if the format is not supported.
- *
- * Weston requires GBM_FORMAT_XRGB8888 only for now.
  */
 static int gbm_kms_get_format_plane_count(uint32_t format)
 {
-	int fourcc = gbm_format_canonicalize(format);
-	switch (fourcc) {
-		// 32bpp
-	case GBM_FORMAT_ARGB8888:
-	case GBM_FORMAT_XRGB8888:
-		return 1;
-	default:
+	const struct gbm_format_desc *info = gbm_kms_get_format(format);
+
+	if (!info) {
 		/* invalid argument */
 		errno = EINVAL;
 		return -1;
 	}
+
+	return info->num_planes;
 }
 
 /*
@@ -96,235 +577,2275 @@ static int gbm_kms_is_format_supported(struct gbm_device *gbm,
     return (gbm_kms_get_format_plane_count(format) != -1);
 }
 
-static int gbm_kms_get_format_modifier_plane_count(struct gbm_device *gbm,
-						   uint32_t format,
-						   uint64_t modifier)
+static void gbm_kms_add_modifier(struct gbm_kms_device *dev,
+				 uint32_t format, uint64_t modifier,
+				 int *size)
 {
-	if (modifier != DRM_FORMAT_MOD_LINEAR) {
-		errno = EINVAL;
-		return -1;
+	struct gbm_kms_modifier *mods;
+	int i;
+
+	for (i = 0; i < dev->num_modifiers; i++) {
+		if (dev->modifiers[i].format == format &&
+		    dev->modifiers[i].modifier == modifier)
+			return;
 	}
 
-	return gbm_kms_get_format_plane_count(format);
-}
+	if (dev->num_modifiers == *size) {
+		int n = *size ? *size * 2 : 32;
 
-static int gbm_kms_bo_map_ref(struct gbm_kms_bo *bo)
-{
-	if (bo->map_ref == 0) {
-		int ret = kms_bo_map(bo->bo, &bo->addr);
-		if (ret < 0)
-			return ret;
+		if (!(mods = realloc(dev->modifiers, n * sizeof(*mods))))
+			return;
+		dev->modifiers = mods;
+		*size = n;
 	}
 
-	bo->map_ref++;
-	return 0;
+	dev->modifiers[dev->num_modifiers].format = format;
+	dev->modifiers[dev->num_modifiers].modifier = modifier;
+	dev->num_modifiers++;
 }
 
-static void gbm_kms_bo_map_unref(struct gbm_kms_bo *bo)
+static void gbm_kms_add_in_formats(struct gbm_kms_device *dev,
+				   drmModePropertyBlobPtr blob, int *size)
 {
-	if (!bo->addr)
+	struct drm_format_modifier_blob *header = blob->data;
+	struct drm_format_modifier *mods;
+	uint32_t *formats;
+	uint32_t i;
+	int j;
+
+	if (blob->length < sizeof(*header) ||
+	    header->version != FORMAT_BLOB_CURRENT)
+		return;
+
+	// the arrays must lie within the blob, it comes from the driver
+	if (header->formats_offset > blob->length ||
+	    header->formats_offset % sizeof(*formats) ||
+	    header->count_formats >
+	    (blob->length - header->formats_offset) / sizeof(*formats) ||
+	    header->modifiers_offset > blob->length ||
+	    header->modifiers_offset % sizeof(uint64_t) ||
+	    header->count_modifiers >
+	    (blob->length - header->modifiers_offset) / sizeof(*mods))
 		return;
 
-	bo->map_ref--;
-	if (bo->map_ref == 0) {
-		kms_bo_unmap(bo->bo);
-		bo->addr = NULL;
+	formats = (uint32_t*)((char*)header + header->formats_offset);
+	mods = (struct drm_format_modifier*)
+		((char*)header + header->modifiers_offset);
+
+	for (i = 0; i < header->count_modifiers; i++) {
+		for (j = 0; j < 64; j++) {
+			uint32_t n = mods[i].offset + j;
+
+			if (!(mods[i].formats & (1ULL << j)) ||
+			    n >= header->count_formats)
+				continue;
+
+			gbm_kms_add_modifier(dev, formats[n],
+					     mods[i].modifier, size);
+		}
 	}
 }
 
-static void gbm_kms_bo_close_handle(int fd, uint32_t handle)
+/*
+ * Collect the format/modifier pairs of the planes the DRM client sees.
+ * Primary and cursor planes are only among them if the caller has set
+ * DRM_CLIENT_CAP_UNIVERSAL_PLANES (atomic clients always have); we don't
+ * set it ourselves as that would change what the fd reports to the
+ * caller as well. If the driver has no IN_FORMATS, the list stays empty
+ * and only linear buffers are accepted.
+ */
+static void gbm_kms_query_modifiers(struct gbm_kms_device *dev)
 {
-	struct drm_gem_close gem_close = { .handle = handle };
+	drmModePlaneResPtr res;
+	uint32_t i, j;
+	int size = 0;
+
+	pthread_mutex_lock(&dev->modifiers_lock);
+	if (dev->modifiers_queried)
+		goto out;
+	dev->modifiers_queried = true;
+
+	if (!(res = drmModeGetPlaneResources(dev->base.fd)))
+		goto out;
+
+	for (i = 0; i < res->count_planes; i++) {
+		drmModeObjectPropertiesPtr props;
+
+		props = drmModeObjectGetProperties(dev->base.fd,
+						   res->planes[i],
+						   DRM_MODE_OBJECT_PLANE);
+		if (!props)
+			continue;
+
+		for (j = 0; j < props->count_props; j++) {
+			drmModePropertyPtr prop;
+			drmModePropertyBlobPtr blob;
+
+			prop = drmModeGetProperty(dev->base.fd, props->props[j]);
+			if (!prop)
+				continue;
+
+			if (strcmp(prop->name, "IN_FORMATS")) {
+				drmModeFreeProperty(prop);
+				continue;
+			}
+			drmModeFreeProperty(prop);
 
-	if (!handle)
-		return;
+			blob = drmModeGetPropertyBlob(dev->base.fd,
+						      props->prop_values[j]);
+			if (blob) {
+				gbm_kms_add_in_formats(dev, blob, &size);
+				drmModeFreePropertyBlob(blob);
+			}
+			break;
+		}
 
-	if (drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close))
-		GBM_DEBUG("%s: %s: DRM_IOCTL_GEM_CLOSE failed. (%s)\n",
-			  __FILE__, __func__, strerror(errno));
+		drmModeFreeObjectProperties(props);
+	}
+
+	drmModeFreePlaneResources(res);
+ out:
+	// the list is never touched again once queried
+	pthread_mutex_unlock(&dev->modifiers_lock);
 }
 
-static void gbm_kms_bo_destroy(struct gbm_bo *_bo)
+static bool gbm_kms_is_modifier_supported(struct gbm_kms_device *dev,
+					  uint32_t format, uint64_t modifier)
 {
-	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
-
-	if (!bo)
-		return;
+	int i;
 
-	if (bo->allocated) {
-		if (bo->addr)
-			kms_bo_unmap(bo->bo);
+	if (modifier == DRM_FORMAT_MOD_LINEAR)
+		return true;
 
-		if (bo->fd)
-			close(bo->fd);
+	gbm_kms_query_modifiers(dev);
 
-		if (bo->bo)
-			kms_bo_destroy(&bo->bo);
-	} else if (bo->allocated_handle) {
-		if (bo->num_planes == 1) {
-			gbm_kms_bo_close_handle(bo->base.gbm->fd,
-						bo->base.handle.u32);
-		} else {
-			int i;
-			for (i = 0; i < bo->num_planes; i++) {
-				gbm_kms_bo_close_handle(bo->base.gbm->fd,
-							bo->planes[i].handle);
-			}
-		}
+	format = gbm_format_canonicalize(format);
+	for (i = 0; i < dev->num_modifiers; i++) {
+		if (dev->modifiers[i].format == format &&
+		    dev->modifiers[i].modifier == modifier)
+			return true;
 	}
 
-	free(bo);
-
-	return;
+	return false;
 }
 
-static struct gbm_bo *gbm_kms_bo_create(struct gbm_device *gbm,
-					uint32_t width, uint32_t height,
-					uint32_t format, uint32_t usage,
-					const uint64_t *modifiers,
+/*
+ * Dumb buffers are always linear, so the only modifier we can allocate
+ * is DRM_FORMAT_MOD_LINEAR, whatever IN_FORMATS says the planes could
+ * also scan out. LINEAR is taken if the caller lists it, or lists
+ * nothing at all.
+ */
+static uint64_t gbm_kms_select_modifier(const uint64_t *modifiers,
 					const unsigned int count)
 {
-	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
-	struct gbm_kms_bo *bo;
-	int fourcc;
-	unsigned attr[] = {
-		KMS_BO_TYPE, KMS_BO_TYPE_SCANOUT_X8R8G8B8,
-		KMS_WIDTH, 0,
-		KMS_HEIGHT, 0,
-		KMS_TERMINATE_PROP_LIST
-	};
-	int ret;
+	unsigned int i;
 
-	GBM_DEBUG("%s: %s: %d\n", __FILE__, __func__, __LINE__);
+	if (!count)
+		return DRM_FORMAT_MOD_LINEAR;
 
-	if (!(bo = calloc(1, sizeof(struct gbm_kms_bo))))
-		return NULL;
+	for (i = 0; i < count; i++) {
+		if (modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			return DRM_FORMAT_MOD_LINEAR;
+	}
 
-	fourcc = gbm_format_canonicalize(format);
+	return DRM_FORMAT_MOD_INVALID;
+}
 
-	switch (fourcc) {
-		// 32bpp
-	case GBM_FORMAT_ARGB8888:
-	case GBM_FORMAT_XRGB8888:
-		break;
-	default:
-		// unsupported...
-		errno = EINVAL;
-		goto error;
-	}
+static int gbm_kms_get_format_modifier_plane_count(struct gbm_device *gbm,
+						   uint32_t format,
+						   uint64_t modifier)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+
+	if (!gbm_kms_is_modifier_supported(dev, format, modifier)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return gbm_kms_get_format_plane_count(format);
+}
+
+static struct gbm_kms_bo *gbm_kms_bo_new(struct gbm_device *gbm)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	struct gbm_kms_bo *bo;
+	int i;
+
+	if (!(bo = gbm_kms_slab_alloc(&dev->bo_slab)))
+		return NULL;
+
+	bo->base.gbm = gbm;
+	bo->fd = -1;
+	bo->fence = -1;
+	bo->release_fence = -1;
+	for (i = 0; i < MAX_PLANES; i++)
+		bo->plane_fds[i] = -1;
+	bo->refcount = 1;
+	bo->modifier = DRM_FORMAT_MOD_LINEAR;
+	wl_list_init(&bo->wl_link);
+	wl_list_init(&bo->uploads);
+	pthread_mutex_init(&bo->lock, NULL);
+
+	if (dev->registry.enabled)
+		gbm_kms_bo_track_new(bo);
+
+	return bo;
+}
+
+/*
+ * Close the fences attached to the BO, which are of no use to whoever
+ * gets it next.
+ */
+static void gbm_kms_bo_drop_fences(struct gbm_kms_bo *bo)
+{
+	pthread_mutex_lock(&bo->lock);
+	if (bo->fence >= 0)
+		close(bo->fence);
+	if (bo->release_fence >= 0)
+		close(bo->release_fence);
+	bo->fence = bo->release_fence = -1;
+	pthread_mutex_unlock(&bo->lock);
+}
+
+/*
+ * Give the wrapper back to the slab. The buffer itself must be gone.
+ */
+static void gbm_kms_bo_delete(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+
+	gbm_kms_bo_drop_fences(bo);
+	if (bo->record)
+		gbm_kms_bo_track_delete(bo);
+	pthread_mutex_destroy(&bo->lock);
+	gbm_kms_slab_free(&dev->bo_slab, bo);
+}
+
+/*
+ * Dumb buffers are mapped through the DRM device. Anything else, i.e.
+ * imported buffers, is mapped through its DMA-BUF.
+ */
+static int gbm_kms_bo_map_ref_locked(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+
+	if (bo->map_ref == 0 && bo->addr && !bo->map_external) {
+		// kept mapped by map_persistent
+		GBM_KMS_STAT_INC(dev, mmaps_avoided);
+	} else if (bo->map_ref == 0 && !bo->map_external) {
+		off_t offset = 0;
+		size_t size;
+		void *addr;
+		int fd;
+
+		GBM_KMS_STAT_INC(dev, mmaps);
+
+		if (bo->allocated) {
+			struct drm_mode_map_dumb arg = {
+				.handle = bo->alloc_handle,
+			};
+
+			if (drmIoctl(dev->alloc_fd, DRM_IOCTL_MODE_MAP_DUMB,
+				     &arg))
+				return -errno;
+
+			fd = dev->alloc_fd;
+			offset = arg.offset;
+			size = bo->size;
+		} else {
+			off_t end;
+
+			if ((fd = gbm_kms_bo_export_plane_locked(bo, 0)) < 0)
+				return -errno;
+
+			end = lseek(fd, 0, SEEK_END);
+			if (end <= 0)
+				return -EINVAL;
+			size = end;
+		}
+
+		addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, offset);
+		if (addr == MAP_FAILED)
+			return -errno;
+
+		bo->addr = addr;
+		bo->map_size = size;
+	}
+
+	bo->map_ref++;
+	return 0;
+}
+
+static void gbm_kms_bo_unmap_addr(struct gbm_kms_bo *bo)
+{
+	if (!bo->addr || bo->map_external)
+		return;
+
+	munmap(bo->addr, bo->map_size);
+	bo->map_size = 0;
+	bo->addr = NULL;
+}
+
+static int gbm_kms_bo_map_ref(struct gbm_kms_bo *bo)
+{
+	int ret;
+
+	pthread_mutex_lock(&bo->lock);
+	ret = gbm_kms_bo_map_ref_locked(bo);
+	pthread_mutex_unlock(&bo->lock);
+
+	return ret;
+}
+
+static void gbm_kms_bo_map_unref(struct gbm_kms_bo *bo)
+{
+	pthread_mutex_lock(&bo->lock);
+	if (bo->map_ref) {
+		bo->map_ref--;
+		if (bo->map_ref == 0 && !bo->map_persistent)
+			gbm_kms_bo_unmap_addr(bo);
+	}
+	pthread_mutex_unlock(&bo->lock);
+}
+
+/*
+ * Fences
+ */
+static bool gbm_kms_fence_signaled(int fence)
+{
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) == 1;
+}
+
+static void gbm_kms_fence_wait(int fence)
+{
+	struct pollfd pfd = { .fd = fence, .events = POLLIN };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+}
+
+/*
+ * Add fence to the one in *slot, so that *slot signals when both did.
+ * Takes over fence.
+ */
+static void gbm_kms_fence_merge(int *slot, int fence)
+{
+	struct sync_merge_data merge = { .name = "gbm", .fd2 = fence };
+
+	if (*slot >= 0 && !gbm_kms_fence_signaled(*slot)) {
+		if (drmIoctl(*slot, SYNC_IOC_MERGE, &merge) == 0) {
+			close(fence);
+			fence = merge.fence;
+		} else {
+			// waiting for the later one is the best we can do
+			GBM_DEBUG("%s: %s: SYNC_IOC_MERGE failed. (%s)\n",
+				  __FILE__, __func__, strerror(errno));
+		}
+	}
+
+	if (*slot >= 0)
+		close(*slot);
+	*slot = fence;
+}
+
+static int gbm_kms_bo_set_fence(struct gbm_bo *_bo, int fence, int release)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+
+	pthread_mutex_lock(&bo->lock);
+	gbm_kms_fence_merge(release ? &bo->release_fence : &bo->fence, fence);
+	pthread_mutex_unlock(&bo->lock);
+
+	return 0;
+}
+
+static int gbm_kms_bo_get_fence(struct gbm_bo *_bo, int release)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	int *slot = release ? &bo->release_fence : &bo->fence;
+	int fd = -1;
+
+	pthread_mutex_lock(&bo->lock);
+	if (*slot >= 0 && gbm_kms_fence_signaled(*slot)) {
+		close(*slot);
+		*slot = -1;
+	}
+	if (*slot >= 0)
+		fd = fcntl(*slot, F_DUPFD_CLOEXEC, 0);
+	pthread_mutex_unlock(&bo->lock);
+
+	return fd;
+}
+
+/*
+ * Wait on the CPU for the fences that CPU access with the given transfer
+ * flags has to wait for. Reads wait for the producer, writes also for the
+ * consumer to stop using the buffer.
+ */
+static void gbm_kms_bo_wait_fences(struct gbm_kms_bo *bo, uint32_t flags)
+{
+	int fence, release = -1;
+
+	fence = gbm_kms_bo_get_fence(&bo->base, 0);
+	if (flags & GBM_BO_TRANSFER_WRITE)
+		release = gbm_kms_bo_get_fence(&bo->base, 1);
+
+	if (fence >= 0) {
+		gbm_kms_fence_wait(fence);
+		close(fence);
+	}
+	if (release >= 0) {
+		gbm_kms_fence_wait(release);
+		close(release);
+	}
+}
+
+/*
+ * Brackets CPU access for DMA-BUF importers and exporters that need
+ * cache maintenance. BOs which have never been exported are left alone.
+ */
+static void gbm_kms_bo_sync(struct gbm_kms_bo *bo, uint32_t flags,
+			    bool end)
+{
+#ifdef DMA_BUF_IOCTL_SYNC
+	struct dma_buf_sync sync = { 0 };
+
+	if (bo->fd < 0)
+		return;
+
+	sync.flags = end ? DMA_BUF_SYNC_END : DMA_BUF_SYNC_START;
+	if (flags & GBM_BO_TRANSFER_READ)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (flags & GBM_BO_TRANSFER_WRITE)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	if (drmIoctl(bo->fd, DMA_BUF_IOCTL_SYNC, &sync))
+		GBM_DEBUG("%s: %s: DMA_BUF_IOCTL_SYNC failed. (%s)\n",
+			  __FILE__, __func__, strerror(errno));
+#endif
+}
+
+static void gbm_kms_bo_close_handle(int fd, uint32_t handle)
+{
+	struct drm_gem_close gem_close = { .handle = handle };
+
+	if (!handle)
+		return;
+
+	if (drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &gem_close))
+		GBM_DEBUG("%s: %s: DRM_IOCTL_GEM_CLOSE failed. (%s)\n",
+			  __FILE__, __func__, strerror(errno));
+}
+
+static int gbm_kms_prime_fd_to_handle(struct gbm_kms_device *dev, int fd,
+				      uint32_t *handle)
+{
+	uint64_t start;
+	int ret;
+
+	GBM_KMS_STAT_INC(dev, prime_imports);
+	start = _gbm_trace_begin(&dev->base);
+	ret = drmPrimeFDToHandle(dev->base.fd, fd, handle);
+	_gbm_trace_end(&dev->base, GBM_TRACE_PRIME_IMPORT, start);
+
+	return ret;
+}
+
+/*
+ * Import table
+ */
+static inline unsigned gbm_kms_import_hash(uint32_t handle)
+{
+	return handle & (GBM_KMS_IMPORT_HASH_SIZE - 1);
+}
+
+static void gbm_kms_import_table_init(struct gbm_kms_import_table *table)
+{
+	int i;
+
+	pthread_rwlock_init(&table->close_lock, NULL);
+	for (i = 0; i < GBM_KMS_IMPORT_HASH_SIZE; i++) {
+		pthread_mutex_init(&table->handles[i].lock, NULL);
+		wl_list_init(&table->handles[i].list);
+	}
+}
+
+static struct gbm_kms_handle *
+gbm_kms_handle_find_locked(struct gbm_kms_import_bucket *bucket,
+			   uint32_t handle)
+{
+	struct gbm_kms_handle *h;
+
+	wl_list_for_each(h, &bucket->list, link) {
+		if (h->handle == handle)
+			return h;
+	}
+
+	return NULL;
+}
+
+static bool gbm_kms_handle_is_used(struct gbm_kms_import_table *table,
+				   uint32_t handle)
+{
+	struct gbm_kms_import_bucket *bucket =
+		&table->handles[gbm_kms_import_hash(handle)];
+	bool used;
+
+	pthread_mutex_lock(&bucket->lock);
+	used = gbm_kms_handle_find_locked(bucket, handle) != NULL;
+	pthread_mutex_unlock(&bucket->lock);
+
+	return used;
+}
+
+/*
+ * Returns true if the handle is not used anymore and is to be closed.
+ */
+static bool gbm_kms_handle_unref(struct gbm_kms_import_table *table,
+				 uint32_t handle)
+{
+	struct gbm_kms_import_bucket *bucket =
+		&table->handles[gbm_kms_import_hash(handle)];
+	struct gbm_kms_handle *h;
+	bool last = true;
+
+	pthread_mutex_lock(&bucket->lock);
+
+	// not tracked, i.e. nobody else shares it
+	h = gbm_kms_handle_find_locked(bucket, handle);
+	if (h && --h->refcount) {
+		last = false;
+	} else if (h) {
+		wl_list_remove(&h->link);
+		free(h);
+	}
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	return last;
+}
+
+static int gbm_kms_handle_ref(struct gbm_kms_import_table *table,
+			      uint32_t handle)
+{
+	struct gbm_kms_import_bucket *bucket =
+		&table->handles[gbm_kms_import_hash(handle)];
+	struct gbm_kms_handle *h;
+	int ret = 0;
+
+	pthread_mutex_lock(&bucket->lock);
+
+	if ((h = gbm_kms_handle_find_locked(bucket, handle))) {
+		h->refcount++;
+	} else if ((h = calloc(1, sizeof(struct gbm_kms_handle)))) {
+		h->handle = handle;
+		h->refcount = 1;
+		wl_list_insert(&bucket->list, &h->link);
+	} else {
+		ret = -1;
+	}
+
+	pthread_mutex_unlock(&bucket->lock);
+
+	return ret;
+}
+
+/*
+ * Drop a reference to a BO imported from a wl_buffer, the only BOs that
+ * are shared. Returns non-zero while the BO is still referenced.
+ */
+static int gbm_kms_bo_unref(struct gbm_bo *_bo)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	int ret = 0;
+
+	// set up by the binding, and left so after it is gone
+	if (!bo->wl_destroy.notify)
+		return 0;
+
+	pthread_mutex_lock(&bo->lock);
+	if (bo->refcount > 1) {
+		bo->refcount--;
+		ret = 1;
+	} else if (bo->wl_bound) {
+		// the user holds no reference; the binding's isn't theirs
+		ret = 1;
+	}
+	pthread_mutex_unlock(&bo->lock);
+
+	return ret;
+}
+
+static void gbm_kms_bo_close_fds(struct gbm_kms_bo *bo)
+{
+	int i;
+
+	for (i = 1; i < bo->num_planes; i++) {
+		if (bo->plane_fds[i] >= 0 && bo->plane_fds[i] != bo->fd)
+			close(bo->plane_fds[i]);
+	}
+
+	if (bo->fd >= 0)
+		close(bo->fd);
+}
+
+static void gbm_kms_bo_free(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_bo *arena_bo = NULL;
+
+	gbm_kms_stats_account(bo, false);
+	if (bo->arena) {
+		// the mapping and the FD belong to the arena
+		arena_bo = gbm_kms_arena_release(bo);
+		bo->fd = -1;
+	}
+	gbm_kms_bo_unmap_addr(bo);
+	gbm_kms_bo_close_fds(bo);
+
+	if (bo->allocated) {
+		struct gbm_kms_device *dev =
+			(struct gbm_kms_device*)bo->base.gbm;
+		struct drm_mode_destroy_dumb arg = {
+			.handle = bo->alloc_handle,
+		};
+		bool last = true;
+
+		pthread_rwlock_wrlock(&dev->imports.close_lock);
+		if (dev->alloc_fd != dev->base.fd) {
+			if (bo->base.handle.u32 &&
+			    gbm_kms_handle_unref(&dev->imports,
+						 bo->base.handle.u32))
+				gbm_kms_bo_close_handle(dev->base.fd,
+							bo->base.handle.u32);
+		} else {
+			// an import of our own FD may still use the handle, and
+			// closes it when it goes away
+			last = gbm_kms_handle_unref(&dev->imports,
+						    bo->alloc_handle);
+		}
+
+		if (last && drmIoctl(dev->alloc_fd, DRM_IOCTL_MODE_DESTROY_DUMB,
+				     &arg))
+			GBM_DEBUG("%s: %s: DRM_IOCTL_MODE_DESTROY_DUMB failed. (%s)\n",
+				  __FILE__, __func__, strerror(errno));
+		pthread_rwlock_unlock(&dev->imports.close_lock);
+	} else if (bo->allocated_handle) {
+		struct gbm_kms_device *dev =
+			(struct gbm_kms_device*)bo->base.gbm;
+
+		pthread_rwlock_wrlock(&dev->imports.close_lock);
+		if (bo->num_planes == 1) {
+			if (gbm_kms_handle_unref(&dev->imports,
+						 bo->base.handle.u32))
+				gbm_kms_bo_close_handle(dev->base.fd,
+							bo->base.handle.u32);
+		} else {
+			int i;
+			for (i = 0; i < bo->num_planes; i++) {
+				if (gbm_kms_handle_unref(&dev->imports,
+							 bo->planes[i].handle))
+					gbm_kms_bo_close_handle(dev->base.fd,
+							bo->planes[i].handle);
+			}
+		}
+		pthread_rwlock_unlock(&dev->imports.close_lock);
+	}
+
+	gbm_kms_bo_delete(bo);
+
+	// the last BO carved out of the arena is gone
+	if (arena_bo)
+		gbm_kms_bo_free(arena_bo);
+}
+
+/*
+ * BO cache
+ *
+ * Only BOs allocated by gbm_kms_bo_create() are cached, and handed out
+ * again only for the same size, format and usage flags, so that e.g. a
+ * cursor BO never comes back as a scanout buffer. On the way in the user
+ * data, the fences and the CPU mapping, unless the device keeps all
+ * mappings, are dropped, but the dumb buffer and its exported FD are kept
+ * so that a later gbm_kms_bo_create() with the same parameters can take
+ * it back without going to the kernel.
+ */
+static void gbm_kms_bo_cache_init(struct gbm_kms_bo_cache *cache)
+{
+	pthread_mutex_init(&cache->lock, NULL);
+	wl_list_init(&cache->list);
+	cache->count = 0;
+	cache->size = 0;
+
+	cache->max_count = gbm_kms_getenv_ulong("GBM_KMS_BO_CACHE_COUNT",
+						GBM_KMS_BO_CACHE_MAX_COUNT);
+	cache->max_size = gbm_kms_getenv_ulong("GBM_KMS_BO_CACHE_SIZE",
+					       GBM_KMS_BO_CACHE_MAX_SIZE);
+	cache->max_age = gbm_kms_getenv_ulong("GBM_KMS_BO_CACHE_AGE",
+					      GBM_KMS_BO_CACHE_MAX_AGE);
+}
+
+static void gbm_kms_bo_cache_remove(struct gbm_kms_bo_cache *cache,
+				    struct gbm_kms_bo *bo)
+{
+	wl_list_remove(&bo->cache_link);
+	cache->count--;
+	cache->size -= bo->size;
+}
+
+/*
+ * Move the expired entries to dead. They are freed by the caller after
+ * dropping the cache lock, so that the ioctls don't serialize everybody.
+ */
+static void gbm_kms_bo_cache_evict_locked(struct gbm_kms_bo_cache *cache,
+					  uint64_t now, struct wl_list *dead)
+{
+	struct gbm_kms_bo *bo, *tmp;
+
+	// the oldest entries are at the tail
+	wl_list_for_each_reverse_safe(bo, tmp, &cache->list, cache_link) {
+		if (cache->count <= cache->max_count &&
+		    cache->size <= cache->max_size &&
+		    (!cache->budget || cache->size <= cache->budget) &&
+		    now - bo->cached_at < cache->max_age)
+			break;
+
+		gbm_kms_bo_cache_remove(cache, bo);
+		wl_list_insert(dead, &bo->cache_link);
+		cache->evictions++;
+	}
+}
+
+static void gbm_kms_bo_cache_free_list(struct wl_list *dead)
+{
+	struct gbm_kms_bo *bo, *tmp;
+
+	wl_list_for_each_safe(bo, tmp, dead, cache_link)
+		gbm_kms_bo_free(bo);
+}
+
+static void gbm_kms_bo_cache_flush(struct gbm_kms_bo_cache *cache)
+{
+	struct gbm_kms_bo *bo, *tmp;
+	struct wl_list dead;
+
+	wl_list_init(&dead);
+
+	pthread_mutex_lock(&cache->lock);
+	wl_list_for_each_safe(bo, tmp, &cache->list, cache_link) {
+		gbm_kms_bo_cache_remove(cache, bo);
+		wl_list_insert(&dead, &bo->cache_link);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	gbm_kms_bo_cache_free_list(&dead);
+}
+
+static bool gbm_kms_bo_cache_put(struct gbm_kms_bo_cache *cache,
+				 struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct wl_list dead;
+
+	if (!bo->allocated || !cache->max_count || bo->size > cache->max_size ||
+	    (cache->budget && bo->size > cache->budget))
+		return false;
+
+	// a mapping kept for the last owner only, e.g. a surface, goes
+	bo->map_persistent = dev->persistent_map;
+	if (!bo->map_persistent)
+		gbm_kms_bo_unmap_addr(bo);
+	gbm_kms_bo_drop_fences(bo);
+	bo->map_ref = 0;
+	bo->locked = 0;
+	bo->base.user_data = NULL;
+	bo->base.destroy_user_data = NULL;
+
+	wl_list_init(&dead);
+
+	pthread_mutex_lock(&cache->lock);
+	bo->cached_at = gbm_kms_get_time_ms();
+	wl_list_insert(&cache->list, &bo->cache_link);
+	cache->count++;
+	cache->size += bo->size;
+
+	gbm_kms_bo_cache_evict_locked(cache, bo->cached_at, &dead);
+	pthread_mutex_unlock(&cache->lock);
+
+	gbm_kms_bo_cache_free_list(&dead);
+
+	return true;
+}
+
+static struct gbm_kms_bo *gbm_kms_bo_cache_get(struct gbm_kms_bo_cache *cache,
+					       uint32_t width, uint32_t height,
+					       uint32_t format, uint32_t usage)
+{
+	struct gbm_kms_bo *bo, *found = NULL;
+	struct wl_list dead;
+
+	wl_list_init(&dead);
+
+	pthread_mutex_lock(&cache->lock);
+	gbm_kms_bo_cache_evict_locked(cache, gbm_kms_get_time_ms(), &dead);
+
+	wl_list_for_each(bo, &cache->list, cache_link) {
+		if (bo->base.width == width && bo->base.height == height &&
+		    bo->base.format == format && bo->usage == usage) {
+			gbm_kms_bo_cache_remove(cache, bo);
+			found = bo;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	gbm_kms_bo_cache_free_list(&dead);
+
+	return found;
+}
+
+/*
+ * Free the least recently used entries until at most keep bytes are
+ * cached. Returns the number of bytes freed.
+ */
+static uint64_t gbm_kms_bo_cache_trim(struct gbm_kms_bo_cache *cache,
+				      size_t keep)
+{
+	struct gbm_kms_bo *bo, *tmp;
+	struct wl_list dead;
+	uint64_t freed = 0;
+
+	wl_list_init(&dead);
+
+	pthread_mutex_lock(&cache->lock);
+	wl_list_for_each_reverse_safe(bo, tmp, &cache->list, cache_link) {
+		if (cache->size <= keep)
+			break;
+
+		freed += bo->size;
+		gbm_kms_bo_cache_remove(cache, bo);
+		wl_list_insert(&dead, &bo->cache_link);
+		cache->evictions++;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	gbm_kms_bo_cache_free_list(&dead);
+
+	return freed;
+}
+
+static void gbm_kms_flush_cache(struct gbm_device *gbm)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+
+	gbm_kms_bo_cache_flush(&dev->cache);
+}
+
+static int gbm_kms_set_memory_budget(struct gbm_device *gbm, uint64_t bytes)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	struct gbm_kms_bo_cache *cache = &dev->cache;
+	struct wl_list dead;
+
+	wl_list_init(&dead);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->budget = bytes > SIZE_MAX ? SIZE_MAX : bytes;
+	gbm_kms_bo_cache_evict_locked(cache, gbm_kms_get_time_ms(), &dead);
+	pthread_mutex_unlock(&cache->lock);
+
+	gbm_kms_bo_cache_free_list(&dead);
+
+	return 0;
+}
+
+static uint64_t gbm_kms_trim_cache(struct gbm_device *gbm, uint64_t keep)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+
+	return gbm_kms_bo_cache_trim(&dev->cache,
+				     keep > SIZE_MAX ? SIZE_MAX : keep);
+}
+
+/*
+ * Memory pressure
+ *
+ * The kernel notifies PSI triggers with POLLPRI. Cached BOs are the only
+ * memory we may give back without anybody noticing, so each notification
+ * flushes the cache.
+ */
+static void *gbm_kms_pressure_thread(void *arg)
+{
+	struct gbm_kms_device *dev = arg;
+	struct pollfd fds[2] = {
+		{ .fd = dev->pressure.fd, .events = POLLPRI },
+		{ .fd = dev->pressure.wake_fd, .events = POLLIN },
+	};
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents || (fds[0].revents & (POLLERR | POLLNVAL)))
+			break;
+
+		if (fds[0].revents & POLLPRI) {
+			GBM_DEBUG("%s: %s: memory pressure, flushing the BO cache\n",
+				  __FILE__, __func__);
+			gbm_kms_bo_cache_flush(&dev->cache);
+		}
+	}
+
+	return NULL;
+}
+
+static void gbm_kms_pressure_init(struct gbm_kms_device *dev)
+{
+	struct gbm_kms_pressure *pressure = &dev->pressure;
+	const char *trigger = getenv("GBM_KMS_PSI_TRIGGER");
+
+	pressure->fd = -1;
+	pressure->wake_fd = -1;
+
+	if (!trigger || !*trigger)
+		return;
+
+	pressure->fd = open("/proc/pressure/memory",
+			    O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (pressure->fd < 0)
+		goto error;
+
+	// the trigger includes the terminating NUL
+	if (write(pressure->fd, trigger, strlen(trigger) + 1) < 0)
+		goto error;
+
+	pressure->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (pressure->wake_fd < 0)
+		goto error;
+
+	if (pthread_create(&pressure->thread, NULL, gbm_kms_pressure_thread,
+			   dev))
+		goto error;
+
+	return;
+
+ error:
+	GBM_DEBUG("%s: %s: can't watch memory pressure. %s\n",
+		  __FILE__, __func__, strerror(errno));
+	if (pressure->wake_fd >= 0)
+		close(pressure->wake_fd);
+	if (pressure->fd >= 0)
+		close(pressure->fd);
+	pressure->fd = -1;
+	pressure->wake_fd = -1;
+}
+
+static void gbm_kms_pressure_fini(struct gbm_kms_pressure *pressure)
+{
+	if (pressure->fd < 0)
+		return;
+
+	eventfd_write(pressure->wake_fd, 1);
+	pthread_join(pressure->thread, NULL);
+	close(pressure->wake_fd);
+	close(pressure->fd);
+}
+
+/*
+ * Give a cursor buffer back to the pool. Whatever the last user attached
+ * to it is dropped, as with the BO cache.
+ */
+static bool gbm_kms_cursor_pool_put(struct gbm_kms_cursor_pool *pool,
+				    struct gbm_kms_bo *bo)
+{
+	unsigned int i;
+
+	gbm_kms_bo_drop_fences(bo);
+	bo->locked = 0;
+	bo->base.user_data = NULL;
+	bo->base.destroy_user_data = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->count; i++) {
+		if (pool->bo[i] == bo) {
+			pool->busy[i] = false;
+			pool->released[i] = ++pool->releases;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return i < pool->count;
+}
+
+static void gbm_kms_bo_destroy(struct gbm_bo *_bo)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_device *dev;
+
+	if (!bo)
+		return;
+
+	dev = (struct gbm_kms_device*)bo->base.gbm;
+	if (bo->record && !gbm_kms_bo_track_drop(bo)) {
+		// cached or pooled already; freeing it again corrupts both
+		void *frames[GBM_KMS_TRACK_FRAMES];
+
+		dprintf(STDERR_FILENO, "gbm: BO %p destroyed twice\n",
+			(void*)bo);
+		gbm_kms_backtrace_dump(frames, gbm_kms_backtrace(frames),
+				       STDERR_FILENO);
+		return;
+	}
+	GBM_KMS_STAT_INC(dev, bo_destroyed);
+	if (bo->pooled && gbm_kms_cursor_pool_put(&dev->cursor, bo))
+		return;
+	if (gbm_kms_bo_cache_put(&dev->cache, bo))
+		return;
+
+	gbm_kms_bo_free(bo);
+}
+
+/*
+ * Work out everything that is common to all BOs of a given size and
+ * format: the plane layout, the modifier, and the dumb buffer request.
+ * Returns the canonical fourcc, or 0 with errno set.
+ */
+static uint32_t gbm_kms_bo_prepare(struct gbm_kms_device *dev,
+				   uint32_t width, uint32_t height,
+				   uint32_t format,
+				   const uint64_t *modifiers,
+				   const unsigned int count,
+				   const struct gbm_format_desc **desc,
+				   uint64_t *modifier,
+				   struct drm_mode_create_dumb *arg)
+{
+	const struct gbm_format_desc *info;
+	uint32_t fourcc;
+	int i;
+
+	fourcc = gbm_format_canonicalize(format);
+
+	if (!(*desc = info = gbm_kms_get_format(fourcc))) {
+		// unsupported...
+		errno = EINVAL;
+		return 0;
+	}
+
+	*modifier = gbm_kms_select_modifier(modifiers, count);
+	if (*modifier == DRM_FORMAT_MOD_INVALID) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	/*
+	 * The dumb buffer is sized for the first plane. The rows of the
+	 * other planes follow below it in units of its pitch.
+	 */
+	memset(arg, 0, sizeof(*arg));
+	arg->width = width;
+	arg->height = height;
+	arg->bpp = info->cpp[0] * 8;
+	for (i = 1; i < info->num_planes; i++) {
+		uint32_t h = (height + info->vsub - 1) / info->vsub;
+		uint32_t div = info->cpp[0] * info->hsub;
+
+		arg->height += (h * info->cpp[i] + div - 1) / div;
+	}
+
+	return fourcc;
+}
+
+static struct gbm_kms_bo *gbm_kms_bo_alloc(struct gbm_kms_device *dev,
+					   uint32_t width, uint32_t height,
+					   uint32_t fourcc, uint32_t usage,
+					   const struct gbm_format_desc *info,
+					   uint64_t modifier,
+					   struct drm_mode_create_dumb arg)
+{
+	struct gbm_kms_bo *bo;
+	uint32_t offset;
+	uint64_t start;
+	int i, ret;
+
+	usage &= GBM_KMS_BO_CACHE_USAGE;
+
+	// Recycle a cached BO if we have one
+	bo = gbm_kms_bo_cache_get(&dev->cache, width, height, fourcc, usage);
+	if (bo) {
+		GBM_KMS_STAT_INC(dev, cache_hits);
+		gbm_kms_bo_track_hold(bo);
+		goto map;
+	}
+	if (dev->cache.max_count)
+		GBM_KMS_STAT_INC(dev, cache_misses);
+
+	if (!(bo = gbm_kms_bo_new(&dev->base)))
+		return NULL;
+
+	// Create BO
+	start = _gbm_trace_begin(&dev->base);
+	ret = drmIoctl(dev->alloc_fd, DRM_IOCTL_MODE_CREATE_DUMB, &arg);
+	if (ret && errno == ENOMEM && gbm_kms_bo_cache_trim(&dev->cache, 0)) {
+		// what the cache held may be just what we are short of
+		ret = drmIoctl(dev->alloc_fd, DRM_IOCTL_MODE_CREATE_DUMB, &arg);
+	}
+	_gbm_trace_end(&dev->base, GBM_TRACE_CREATE_DUMB, start);
+	if (ret) {
+		GBM_DEBUG("%s: %s: DRM_IOCTL_MODE_CREATE_DUMB failed. %s\n",
+			  __FILE__, __func__, strerror(errno));
+		goto error;
+	}
+
+	bo->base.width = width;
+	bo->base.height = height;
+	bo->base.format = fourcc;
+	bo->base.handle.u32 = arg.handle;
+	bo->base.stride = arg.pitch;
+	bo->alloc_handle = arg.handle;
+	bo->allocated = true;
+	bo->usage = usage;
+
+	/*
+	 * Imports of the buffer's FD get the same handle back, so it is
+	 * tracked like theirs. On a render node, the buffer is handed over
+	 * to the node we were opened on first.
+	 */
+	if (dev->alloc_fd == dev->base.fd) {
+		// not closed by anybody else before DESTROY_DUMB if this fails
+		if (gbm_kms_handle_ref(&dev->imports, arg.handle))
+			goto error;
+	} else {
+		if (drmPrimeHandleToFD(dev->alloc_fd, arg.handle,
+				       DRM_CLOEXEC | DRM_RDWR, &bo->fd))
+			goto error_render;
+
+		pthread_rwlock_rdlock(&dev->imports.close_lock);
+		ret = gbm_kms_prime_fd_to_handle(dev, bo->fd,
+						 &bo->base.handle.u32);
+		if (!ret && gbm_kms_handle_ref(&dev->imports,
+					       bo->base.handle.u32)) {
+			// nobody knows about it yet; we can close it right here
+			gbm_kms_bo_close_handle(dev->base.fd, bo->base.handle.u32);
+			ret = -1;
+		}
+		pthread_rwlock_unlock(&dev->imports.close_lock);
+		if (ret) {
+			bo->base.handle.u32 = 0;
+			goto error_render;
+		}
+	}
+
+	bo->size = arg.size;
+	bo->num_planes = info->num_planes;
+
+	offset = 0;
+	for (i = 0; i < info->num_planes; i++) {
+		uint32_t h = i ? (height + info->vsub - 1) / info->vsub : height;
+
+		bo->planes[i].handle = bo->base.handle.u32;
+		bo->planes[i].stride = i ? bo->base.stride * info->cpp[i] /
+			(info->cpp[0] * info->hsub) : bo->base.stride;
+		bo->offsets[i] = offset;
+		offset += bo->planes[i].stride * h;
+	}
+
+	bo->modifier = modifier;
+	gbm_kms_stats_account(bo, true);
+
+ map:
+	bo->map_persistent = dev->persistent_map;
+
+	// Map to the user space for bo_write
+	if (usage & (uint32_t)GBM_BO_USE_WRITE) {
+		ret = gbm_kms_bo_map_ref(bo);
+		if (ret) {
+			errno = -ret;
+			goto error;
+		}
+	}
+
+	return bo;
+
+ error_render:
+	GBM_DEBUG("%s: %s: import into the render node failed. %s\n",
+		  __FILE__, __func__, strerror(errno));
+ error:
+	GBM_DEBUG("%s: %s: %d: ERROR!!!!\n", __FILE__, __func__, __LINE__);
+	gbm_kms_bo_free(bo);
+	return NULL;
+}
+
+/*
+ * Cursor pool
+ *
+ * Compositors swap cursor images a lot, for animated cursors and one
+ * cursor per seat. Cursor BOs of the hardware cursor size come from a
+ * small ring of dumb buffers that stay mapped and exported, so taking one
+ * and writing a new image into it with gbm_bo_write() does not go to the
+ * kernel at all. Other sizes, and any request the ring can't serve, are
+ * allocated as usual.
+ */
+static void gbm_kms_cursor_pool_init(struct gbm_kms_device *dev)
+{
+	struct gbm_kms_cursor_pool *pool = &dev->cursor;
+	uint64_t cap;
+
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pool->width = 64;
+	pool->height = 64;
+	if (!drmGetCap(dev->alloc_fd, DRM_CAP_CURSOR_WIDTH, &cap) && cap)
+		pool->width = cap;
+	if (!drmGetCap(dev->alloc_fd, DRM_CAP_CURSOR_HEIGHT, &cap) && cap)
+		pool->height = cap;
+
+	pool->count = gbm_kms_getenv_ulong("GBM_KMS_CURSOR_POOL", 4);
+	if (pool->count > GBM_KMS_CURSOR_POOL_MAX)
+		pool->count = GBM_KMS_CURSOR_POOL_MAX;
+}
+
+static void gbm_kms_cursor_pool_fill_locked(struct gbm_kms_device *dev,
+					    const struct gbm_format_desc *info,
+					    struct drm_mode_create_dumb arg)
+{
+	struct gbm_kms_cursor_pool *pool = &dev->cursor;
+	struct gbm_kms_bo *bo;
+	unsigned int i;
+
+	pool->filled = true;
+
+	for (i = 0; i < pool->count; i++) {
+		bo = gbm_kms_bo_alloc(dev, pool->width, pool->height,
+				      GBM_FORMAT_ARGB8888, GBM_BO_USE_CURSOR,
+				      info, DRM_FORMAT_MOD_LINEAR, arg);
+		if (!bo)
+			break;
+
+		bo->pooled = true;
+		bo->map_persistent = true;
+		if (bo->record)
+			gbm_kms_bo_track_drop(bo);
+		if (gbm_kms_bo_map_ref(bo) ||
+		    gbm_bo_borrow_fd_for_plane(&bo->base, 0) < 0) {
+			gbm_kms_bo_free(bo);
+			break;
+		}
+		pool->bo[i] = bo;
+	}
+
+	// make do with what we got
+	pool->count = i;
+}
+
+static struct gbm_kms_bo *gbm_kms_cursor_pool_get(struct gbm_kms_device *dev,
+						  uint32_t fourcc,
+						  const struct gbm_format_desc *info,
+						  struct drm_mode_create_dumb arg)
+{
+	struct gbm_kms_cursor_pool *pool = &dev->cursor;
+	struct gbm_kms_bo *bo = NULL;
+	unsigned int i, n;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (!pool->filled)
+		gbm_kms_cursor_pool_fill_locked(dev, info, arg);
+
+	for (i = 0, n = pool->count; i < pool->count; i++) {
+		if (!pool->busy[i] &&
+		    (n == pool->count || pool->released[i] < pool->released[n]))
+			n = i;
+	}
+	if (n < pool->count) {
+		pool->busy[n] = true;
+		bo = pool->bo[n];
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (bo && bo->base.format != fourcc) {
+		// ARGB8888 and XRGB8888 share the layout, but are counted apart
+		gbm_kms_stats_account(bo, false);
+		bo->base.format = fourcc;
+		gbm_kms_stats_account(bo, true);
+	}
+	if (bo)
+		gbm_kms_bo_track_hold(bo);
+
+	return bo;
+}
+
+/*
+ * All BOs have to be destroyed before the device, as their wrappers go
+ * with the slab. A cursor BO the user still holds is leaked like any
+ * other, and reported.
+ */
+static void gbm_kms_cursor_pool_fini(struct gbm_kms_cursor_pool *pool)
+{
+	unsigned int i, busy = 0;
+
+	for (i = 0; i < pool->count; i++) {
+		if (pool->busy[i])
+			busy++;
+		else
+			gbm_kms_bo_free(pool->bo[i]);
+	}
+	pool->count = 0;
+
+	if (busy)
+		dprintf(STDERR_FILENO, "gbm: %u cursor BOs still held when "
+			"the device was destroyed\n", busy);
+}
+
+/*
+ * Suballocation
+ *
+ * Tiles, glyph atlases and thumbnails come in the hundreds, and each
+ * dumb buffer costs a GEM object, at least a page and an FD once
+ * exported. With GBM_KMS_SUBALLOC set to a size in bytes, linear single
+ * plane BOs up to that size are carved out of shared 1MiB dumb buffers
+ * instead, as long as they are neither scanned out nor rendered to. They
+ * share the handle and the DMA-BUF of the arena and report where they
+ * start through gbm_bo_get_offset(). One empty arena is kept around, so
+ * that creating and destroying a single small BO over and over does not
+ * set up a new arena each time.
+ */
+static void gbm_kms_suballoc_init(struct gbm_kms_device *dev)
+{
+	struct gbm_kms_suballocator *suballoc = &dev->suballoc;
+
+	pthread_mutex_init(&suballoc->lock, NULL);
+	wl_list_init(&suballoc->arenas);
+
+	// anything bigger would leave most of an arena unused
+	suballoc->max_size = gbm_kms_getenv_ulong("GBM_KMS_SUBALLOC", 0);
+	if (suballoc->max_size > GBM_KMS_ARENA_SIZE / 4)
+		suballoc->max_size = GBM_KMS_ARENA_SIZE / 4;
+}
+
+static void gbm_kms_suballoc_fini(struct gbm_kms_suballocator *suballoc)
+{
+	struct gbm_kms_arena *arena, *tmp;
+
+	wl_list_for_each_safe(arena, tmp, &suballoc->arenas, link) {
+		gbm_kms_bo_free(arena->bo);
+		free(arena);
+	}
+	pthread_mutex_destroy(&suballoc->lock);
+}
+
+static struct gbm_kms_arena *gbm_kms_arena_new(struct gbm_kms_device *dev)
+{
+	const struct gbm_format_desc *info =
+		_gbm_format_get_desc(GBM_FORMAT_ARGB8888);
+	struct drm_mode_create_dumb arg = {
+		.width = 1024,
+		.height = GBM_KMS_ARENA_SIZE / 4096,
+		.bpp = 32,
+	};
+	struct gbm_kms_arena *arena;
+	struct gbm_kms_bo *bo;
+
+	if (!(arena = calloc(1, sizeof(struct gbm_kms_arena))))
+		return NULL;
+
+	bo = gbm_kms_bo_alloc(dev, arg.width, arg.height, info->format, 0,
+			      info, DRM_FORMAT_MOD_LINEAR, arg);
+	if (!bo) {
+		free(arena);
+		return NULL;
+	}
+
+	// accounted through the BOs carved out of it
+	gbm_kms_stats_account(bo, false);
+	if (bo->record)
+		gbm_kms_bo_track_drop(bo);
+
+	bo->map_persistent = true;
+	if (gbm_kms_bo_map_ref(bo) ||
+	    gbm_bo_borrow_fd_for_plane(&bo->base, 0) < 0) {
+		gbm_kms_bo_free(bo);
+		free(arena);
+		return NULL;
+	}
+
+	arena->bo = bo;
+	return arena;
+}
+
+// Returns the first of n free granules in a row, or -1.
+static int gbm_kms_arena_find(struct gbm_kms_arena *arena, unsigned int n)
+{
+	unsigned int i, run = 0;
+
+	for (i = 0; i < GBM_KMS_ARENA_GRANULES; i++) {
+		uint64_t word = arena->used[i / 64];
+
+		if (i % 64 == 0 && word == UINT64_MAX) {
+			run = 0;
+			i += 63;
+		} else if (word & (1ULL << (i % 64))) {
+			run = 0;
+		} else if (++run == n) {
+			return i + 1 - n;
+		}
+	}
+
+	return -1;
+}
+
+static void gbm_kms_arena_mark(struct gbm_kms_arena *arena,
+			       unsigned int first, unsigned int n, bool used)
+{
+	unsigned int i;
+
+	for (i = first; i < first + n; i++) {
+		if (used)
+			arena->used[i / 64] |= 1ULL << (i % 64);
+		else
+			arena->used[i / 64] &= ~(1ULL << (i % 64));
+	}
+
+	if (used)
+		arena->num_used += n;
+	else
+		arena->num_used -= n;
+}
+
+/*
+ * Give the space of bo back to its arena. Returns the arena's own BO to
+ * be freed if nothing is carved out of it anymore.
+ */
+static struct gbm_kms_bo *gbm_kms_arena_release(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_arena *arena = bo->arena;
+	struct gbm_kms_bo *arena_bo = NULL;
+	unsigned int n;
+
+	n = (bo->size + GBM_KMS_ARENA_GRANULE - 1) / GBM_KMS_ARENA_GRANULE;
+
+	pthread_mutex_lock(&dev->suballoc.lock);
+	gbm_kms_arena_mark(arena, bo->offsets[0] / GBM_KMS_ARENA_GRANULE,
+			   n, false);
+	if (!arena->num_used) {
+		struct gbm_kms_arena *other;
+
+		// keep this one unless there is another empty one
+		wl_list_for_each(other, &dev->suballoc.arenas, link) {
+			if (other != arena && !other->num_used)
+				break;
+		}
+		if (&other->link != &dev->suballoc.arenas) {
+			wl_list_remove(&arena->link);
+			arena_bo = arena->bo;
+			free(arena);
+		}
+	}
+	pthread_mutex_unlock(&dev->suballoc.lock);
+
+	bo->arena = NULL;
+	return arena_bo;
+}
+
+static struct gbm_kms_bo *gbm_kms_suballoc_bo(struct gbm_kms_device *dev,
+					      uint32_t width, uint32_t height,
+					      uint32_t fourcc,
+					      const struct gbm_format_desc *info)
+{
+	struct gbm_kms_suballocator *suballoc = &dev->suballoc;
+	struct gbm_kms_arena *arena;
+	struct gbm_kms_bo *bo;
+	uint32_t stride, size;
+	unsigned int n;
+	int first = -1;
+
+	// keep rows 64 byte aligned like the dumb buffers of most drivers
+	stride = (width * info->cpp[0] + 63) & ~63U;
+	size = stride * height;
+	if (!size || size > suballoc->max_size)
+		return NULL;
+	n = (size + GBM_KMS_ARENA_GRANULE - 1) / GBM_KMS_ARENA_GRANULE;
+
+	if (!(bo = gbm_kms_bo_new(&dev->base)))
+		return NULL;
+
+	pthread_mutex_lock(&suballoc->lock);
+
+	wl_list_for_each(arena, &suballoc->arenas, link) {
+		if ((first = gbm_kms_arena_find(arena, n)) >= 0)
+			break;
+	}
+
+	if (first < 0) {
+		if (!(arena = gbm_kms_arena_new(dev))) {
+			pthread_mutex_unlock(&suballoc->lock);
+			gbm_kms_bo_delete(bo);
+			return NULL;
+		}
+		wl_list_insert(&suballoc->arenas, &arena->link);
+		first = 0;
+	}
+
+	gbm_kms_arena_mark(arena, first, n, true);
+
+	pthread_mutex_unlock(&suballoc->lock);
+
+	bo->base.width = width;
+	bo->base.height = height;
+	bo->base.format = fourcc;
+	bo->base.stride = stride;
+	bo->base.handle.u32 = arena->bo->base.handle.u32;
+	bo->size = size;
+	bo->num_planes = 1;
+	bo->planes[0].handle = bo->base.handle.u32;
+	bo->planes[0].stride = stride;
+	bo->offsets[0] = first * GBM_KMS_ARENA_GRANULE;
+	bo->arena = arena;
+
+	// always mapped, through the arena
+	bo->fd = arena->bo->fd;
+	bo->addr = (uint8_t*)arena->bo->addr + bo->offsets[0];
+	bo->map_external = true;
+
+	gbm_kms_stats_account(bo, true);
+
+	return bo;
+}
+
+static struct gbm_bo *gbm_kms_bo_create(struct gbm_device *gbm,
+					uint32_t width, uint32_t height,
+					uint32_t format, uint32_t usage,
+					const uint64_t *modifiers,
+					const unsigned int count)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	const struct gbm_format_desc *info;
+	struct drm_mode_create_dumb arg;
+	struct gbm_kms_bo *bo = NULL;
+	uint64_t modifier;
+	uint32_t fourcc;
+
+	GBM_DEBUG("%s: %s: %d\n", __FILE__, __func__, __LINE__);
+
+	fourcc = gbm_kms_bo_prepare(dev, width, height, format,
+				    modifiers, count, &info, &modifier, &arg);
+	if (!fourcc)
+		return NULL;
+
+	if ((usage & GBM_BO_USE_CURSOR) && dev->cursor.count &&
+	    width == dev->cursor.width && height == dev->cursor.height &&
+	    (fourcc == GBM_FORMAT_ARGB8888 || fourcc == GBM_FORMAT_XRGB8888) &&
+	    modifier == DRM_FORMAT_MOD_LINEAR)
+		bo = gbm_kms_cursor_pool_get(dev, fourcc, info, arg);
+
+	// drmModeAddFB(), the legacy cursor ioctls and gbm_kms_get_bo_fd()
+	// users have no way to pass an offset, so only BOs that are neither
+	// scanned out nor rendered to are carved out
+	if (!bo && dev->suballoc.max_size && info->num_planes == 1 &&
+	    !(usage & (GBM_BO_USE_SCANOUT | GBM_BO_USE_CURSOR |
+		       GBM_BO_USE_RENDERING)) &&
+	    modifier == DRM_FORMAT_MOD_LINEAR)
+		bo = gbm_kms_suballoc_bo(dev, width, height, fourcc, info);
+
+	if (!bo)
+		bo = gbm_kms_bo_alloc(dev, width, height, fourcc, usage, info,
+				      modifier, arg);
+
+	// counted once per BO handed out, wherever it came from
+	if (bo)
+		GBM_KMS_STAT_INC(dev, bo_created);
+
+	return (struct gbm_bo*)bo;
+}
+
+/*
+ * Allocate num identical BOs. Only the format lookup and modifier
+ * negotiation are shared; each BO is still a separate dumb buffer or
+ * cache hit. Either all BOs are returned, or none.
+ */
+static int gbm_kms_bo_create_array(struct gbm_device *gbm,
+				   uint32_t width, uint32_t height,
+				   uint32_t format, uint32_t usage,
+				   const uint64_t *modifiers,
+				   const unsigned int count,
+				   struct gbm_bo **bos, unsigned int num)
+{
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	const struct gbm_format_desc *info;
+	struct drm_mode_create_dumb arg;
+	uint64_t modifier;
+	uint32_t fourcc;
+	unsigned int i;
+	int ret;
+
+	GBM_DEBUG("%s: %s: %d: %u BOs\n", __FILE__, __func__, __LINE__, num);
+
+	fourcc = gbm_kms_bo_prepare(dev, width, height, format,
+				    modifiers, count, &info, &modifier, &arg);
+	if (!fourcc)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		bos[i] = (struct gbm_bo*)gbm_kms_bo_alloc(dev, width, height,
+							  fourcc, usage, info,
+							  modifier, arg);
+		if (!bos[i])
+			goto error;
+		GBM_KMS_STAT_INC(dev, bo_created);
+	}
+
+	return 0;
+
+ error:
+	ret = errno;
+	while (i--) {
+		gbm_kms_bo_destroy(bos[i]);
+		bos[i] = NULL;
+	}
+	errno = ret;
+	return -1;
+}
+
+static void *gbm_kms_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
+			    uint32_t width, uint32_t height, uint32_t flags,
+			    uint32_t *stride, void **map_data)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_map *map;
+	uint32_t cpp = gbm_bo_get_bpp(_bo) / 8;
+	int ret;
+
+	if (x >= bo->base.width || width > bo->base.width - x ||
+	    y >= bo->base.height || height > bo->base.height - y) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	// we can't tell where a pixel is without knowing its size
+	if (x && !cpp) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(flags & GBM_BO_TRANSFER_READ_WRITE))
+		flags = GBM_BO_TRANSFER_READ_WRITE;
+
+	if (!(map = calloc(1, sizeof(struct gbm_kms_map))))
+		return NULL;
+
+	ret = gbm_kms_bo_map_ref(bo);
+	if (ret < 0) {
+		free(map);
+		errno = -ret;
+		return NULL;
+	}
+
+	map->bo = bo;
+	map->flags = flags;
+	gbm_kms_bo_wait_fences(bo, flags);
+	gbm_kms_bo_sync(bo, flags, false);
+	GBM_KMS_STAT_INC((struct gbm_kms_device*)bo->base.gbm, maps);
+
+	*map_data = map;
+	*stride = bo->base.stride;
+	return (uint8_t*)bo->addr + y * bo->base.stride + x * cpp;
+}
+
+static void gbm_kms_bo_unmap(struct gbm_bo *_bo, void *map_data)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_map *map = map_data;
+
+	if (!map || map->bo != bo)
+		return;
+
+	gbm_kms_bo_sync(bo, map->flags, true);
+	gbm_kms_bo_map_unref(bo);
+	free(map);
+	GBM_KMS_STAT_INC((struct gbm_kms_device*)bo->base.gbm, unmaps);
+}
+
+/*
+ * Upload pool
+ *
+ * Writes are handed to a small pool of worker threads, either queued by
+ * gbm_bo_write_async(), or, when they are larger than
+ * GBM_KMS_PARALLEL_WRITE bytes, by gbm_bo_write() and gbm_bo_write_rect()
+ * which then copy along and wait. The first thread to pick a write up
+ * waits for the fences of the BO, then the rows are handed out in
+ * stripes to all threads. Whoever copies the last stripe ends CPU access
+ * and calls back.
+ */
+#define GBM_KMS_UPLOAD_CHUNK_MIN	(64 * 1024)
+#define GBM_KMS_UPLOAD_STRIPE		8	// rows
+
+struct gbm_kms_upload_waiter {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+};
+
+static void gbm_kms_upload_pool_init(struct gbm_kms_upload_pool *pool)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	wl_list_init(&pool->queue);
+
+	// leave half of the CPUs to whoever produces the data
+	pool->max_threads = gbm_kms_getenv_ulong("GBM_KMS_UPLOAD_THREADS",
+						 cpus > 2 ? cpus / 2 : 1);
+	if (pool->max_threads < 1)
+		pool->max_threads = 1;
+	else if (pool->max_threads > GBM_KMS_UPLOAD_THREADS_MAX)
+		pool->max_threads = GBM_KMS_UPLOAD_THREADS_MAX;
+
+	pool->parallel_min = gbm_kms_getenv_ulong("GBM_KMS_PARALLEL_WRITE", 0);
+}
+
+static void gbm_kms_upload_finish(struct gbm_kms_upload *upload)
+{
+	struct gbm_kms_bo *bo = upload->bo;
+	struct gbm_kms_upload_pool *pool =
+		&((struct gbm_kms_device*)bo->base.gbm)->upload;
+
+	gbm_kms_bo_sync(bo, GBM_BO_TRANSFER_WRITE, true);
+	gbm_kms_bo_map_unref(bo);
+
+	// let the next write to the BO start
+	pthread_mutex_lock(&pool->lock);
+	wl_list_remove(&upload->bo_link);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	upload->done(&bo->base, 0, upload->data);
+	free(upload);
+}
+
+static void gbm_kms_upload_copy(struct gbm_kms_upload *upload,
+				unsigned int chunk)
+{
+	uint32_t first = chunk * upload->chunk_rows;
+	uint32_t rows = upload->rows > first ? upload->rows - first : 0;
+	uint8_t *dst = upload->dst + (size_t)first * upload->dst_stride;
+	const uint8_t *src = upload->src + (size_t)first * upload->src_stride;
+
+	if (rows > upload->chunk_rows)
+		rows = upload->chunk_rows;
+
+	if (upload->src_format)
+		gbm_kms_convert_rect(dst, upload->dst_stride,
+				     upload->bo->base.format, src,
+				     upload->src_stride, upload->src_format,
+				     upload->width, rows);
+	else
+		gbm_kms_copy_rect(dst, upload->dst_stride, src,
+				  upload->src_stride, upload->row_bytes, rows);
+
+	// bytes of gbm_bo_write() that don't fill a row
+	if (chunk == upload->num_chunks - 1 && upload->tail) {
+		dst = upload->dst + (size_t)upload->rows * upload->dst_stride;
+		src = upload->src + (size_t)upload->rows * upload->src_stride;
+		gbm_kms_copy_rect(dst, upload->tail, src, upload->tail,
+				  upload->tail, 1);
+	}
+
+	if (__atomic_sub_fetch(&upload->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		gbm_kms_upload_finish(upload);
+}
+
+/*
+ * Takes the next chunk of the upload at the head of the queue. Returns
+ * false if the upload has been handed out completely with this one.
+ */
+static bool gbm_kms_upload_take_locked(struct gbm_kms_upload *upload,
+				       unsigned int *chunk)
+{
+	*chunk = upload->next_chunk++;
+	if (upload->next_chunk < upload->num_chunks)
+		return true;
+
+	wl_list_remove(&upload->link);
+	return false;
+}
+
+/*
+ * Returns the first queued upload that may be worked on, i.e. one that has
+ * been started or is the oldest unfinished write to its BO, or NULL.
+ */
+static struct gbm_kms_upload *
+gbm_kms_upload_next_locked(struct gbm_kms_upload_pool *pool)
+{
+	struct gbm_kms_upload *upload;
+
+	wl_list_for_each(upload, &pool->queue, link) {
+		if (upload->started ||
+		    upload->bo->uploads.next == &upload->bo_link)
+			return upload;
+	}
+
+	return NULL;
+}
+
+static void *gbm_kms_upload_worker(void *arg)
+{
+	struct gbm_kms_upload_pool *pool = arg;
+	struct gbm_kms_upload *upload;
+	unsigned int chunk;
+
+	pthread_mutex_lock(&pool->lock);
+
+	// the queue is drained before quitting
+	for (;;) {
+		if (!(upload = gbm_kms_upload_next_locked(pool))) {
+			if (pool->quit && wl_list_empty(&pool->queue))
+				break;
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		// nobody may copy before the fences have signaled
+		if (!upload->started) {
+			wl_list_remove(&upload->link);
+			pthread_mutex_unlock(&pool->lock);
+
+			gbm_kms_bo_wait_fences(upload->bo, GBM_BO_TRANSFER_WRITE);
+			gbm_kms_bo_sync(upload->bo, GBM_BO_TRANSFER_WRITE, false);
+
+			pthread_mutex_lock(&pool->lock);
+			upload->started = true;
+			wl_list_insert(&pool->queue, &upload->link);
+			pthread_cond_broadcast(&pool->cond);
+			continue;
+		}
+
+		gbm_kms_upload_take_locked(upload, &chunk);
+		pthread_mutex_unlock(&pool->lock);
+
+		gbm_kms_upload_copy(upload, chunk);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+static int gbm_kms_upload_pool_start_locked(struct gbm_kms_upload_pool *pool)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (pool->num_threads)
+		return 0;
+
+	for (i = 0; i < pool->max_threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL,
+				     gbm_kms_upload_worker, pool);
+		if (ret)
+			break;
+	}
+	pool->num_threads = i;
+
+	if (!pool->num_threads) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void gbm_kms_upload_pool_fini(struct gbm_kms_upload_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static void gbm_kms_upload_wake(struct gbm_bo *bo, int status, void *data)
+{
+	struct gbm_kms_upload_waiter *waiter = data;
+
+	pthread_mutex_lock(&waiter->lock);
+	waiter->done = true;
+	pthread_cond_signal(&waiter->cond);
+	pthread_mutex_unlock(&waiter->lock);
+}
+
+/*
+ * Waits until the uploads queued for bo are finished, so that a write
+ * copied directly is not overwritten by an older one.
+ */
+static void gbm_kms_bo_wait_uploads(struct gbm_kms_bo *bo)
+{
+	struct gbm_kms_upload_pool *pool =
+		&((struct gbm_kms_device*)bo->base.gbm)->upload;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!wl_list_empty(&bo->uploads))
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Queue an upload whose copy is described, and which holds a map
+ * reference on its BO. Unless a callback is given, the calling thread
+ * copies along and returns once all is written; if no worker could be
+ * started, that is all by itself. Writes to a BO are started in the
+ * order they are submitted, each once the one before has finished.
+ */
+static int gbm_kms_upload_submit(struct gbm_kms_device *dev,
+				 struct gbm_kms_upload *upload,
+				 gbm_bo_write_done_func done, void *data)
+{
+	struct gbm_kms_upload_pool *pool = &dev->upload;
+	struct gbm_kms_upload_waiter waiter;
+	uint32_t min_rows, threads;
+	unsigned int chunk;
+	bool more;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	ret = gbm_kms_upload_pool_start_locked(pool);
+	threads = pool->num_threads;
+	pthread_mutex_unlock(&pool->lock);
+	if (ret && done)
+		return -1;
+
+	// the caller counts as a thread if it waits
+	if (!done)
+		threads++;
+
+	// one stripe aligned run of rows per thread, unless that is too little
+	upload->chunk_rows = (upload->rows + threads - 1) / threads;
+	min_rows = GBM_KMS_UPLOAD_CHUNK_MIN / (upload->dst_stride ?
+					       upload->dst_stride : 1);
+	if (upload->chunk_rows < min_rows)
+		upload->chunk_rows = min_rows;
+	upload->chunk_rows = (upload->chunk_rows + GBM_KMS_UPLOAD_STRIPE - 1) /
+		GBM_KMS_UPLOAD_STRIPE * GBM_KMS_UPLOAD_STRIPE;
+	upload->num_chunks = upload->rows ?
+		(upload->rows + upload->chunk_rows - 1) / upload->chunk_rows : 1;
+	upload->pending = upload->num_chunks;
+
+	if (done) {
+		upload->done = done;
+		upload->data = data;
+
+		pthread_mutex_lock(&pool->lock);
+		wl_list_insert(upload->bo->uploads.prev, &upload->bo_link);
+		wl_list_insert(pool->queue.prev, &upload->link);
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		return 0;
+	}
+
+	pthread_mutex_init(&waiter.lock, NULL);
+	pthread_cond_init(&waiter.cond, NULL);
+	waiter.done = false;
+	upload->done = gbm_kms_upload_wake;
+	upload->data = &waiter;
+
+	// keep the upload alive while we copy along
+	upload->pending++;
+
+	pthread_mutex_lock(&pool->lock);
+	wl_list_insert(upload->bo->uploads.prev, &upload->bo_link);
+	while (upload->bo->uploads.next != &upload->bo_link)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	gbm_kms_bo_wait_fences(upload->bo, GBM_BO_TRANSFER_WRITE);
+	gbm_kms_bo_sync(upload->bo, GBM_BO_TRANSFER_WRITE, false);
+	upload->started = true;
+
+	pthread_mutex_lock(&pool->lock);
+	wl_list_insert(pool->queue.prev, &upload->link);
+	pthread_cond_broadcast(&pool->cond);
+
+	do {
+		more = gbm_kms_upload_take_locked(upload, &chunk);
+		pthread_mutex_unlock(&pool->lock);
+
+		gbm_kms_upload_copy(upload, chunk);
+
+		pthread_mutex_lock(&pool->lock);
+	} while (more && upload->next_chunk < upload->num_chunks);
+	pthread_mutex_unlock(&pool->lock);
+
+	if (__atomic_sub_fetch(&upload->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		gbm_kms_upload_finish(upload);
+
+	pthread_mutex_lock(&waiter.lock);
+	while (!waiter.done)
+		pthread_cond_wait(&waiter.cond, &waiter.lock);
+	pthread_mutex_unlock(&waiter.lock);
+
+	pthread_cond_destroy(&waiter.cond);
+	pthread_mutex_destroy(&waiter.lock);
+
+	return 0;
+}
+
+/*
+ * Describe writing count bytes from buf to the start of bo, with rows of
+ * the BO's stride. Takes a map reference, which the upload drops when
+ * it is finished.
+ */
+static struct gbm_kms_upload *gbm_kms_upload_new_linear(struct gbm_kms_bo *bo,
+							const void *buf,
+							size_t count)
+{
+	struct gbm_kms_upload *upload;
+	uint32_t stride = bo->base.stride ? bo->base.stride : count;
+	int ret;
 
-	if (usage & (uint32_t)GBM_BO_USE_CURSOR)
-		attr[1] = KMS_BO_TYPE_CURSOR_64X64_A8R8G8B8;
-	attr[3] = width;
-	attr[5] = height;
+	if (!(upload = calloc(1, sizeof(struct gbm_kms_upload))))
+		return NULL;
 
-	// Create BO
-	ret = kms_bo_create(dev->kms, attr, &bo->bo);
-	if (ret) {
+	ret = gbm_kms_bo_map_ref(bo);
+	if (ret < 0) {
+		free(upload);
 		errno = -ret;
-		goto error;
+		return NULL;
 	}
 
-	bo->base.gbm = gbm;
-	bo->base.width = width;
-	bo->base.height = height;
-	bo->base.format = fourcc;
+	upload->bo = bo;
+	upload->dst = bo->addr;
+	upload->src = buf;
+	upload->dst_stride = upload->src_stride = stride;
+	upload->row_bytes = stride;
+	upload->rows = count / stride;
+	upload->tail = count % stride;
 
-	kms_bo_get_prop(bo->bo, KMS_HANDLE, &bo->base.handle.u32);
-	kms_bo_get_prop(bo->bo, KMS_PITCH, &bo->base.stride);
+	return upload;
+}
 
-	bo->size = bo->base.stride * bo->base.height;
-	bo->num_planes = 1;
-	bo->allocated = true;
+static int gbm_kms_bo_write(struct gbm_bo *_bo, const void *buf, size_t count)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_upload *upload;
 
-	if (drmPrimeHandleToFD(dev->base.fd, bo->base.handle.u32,
-			       DRM_CLOEXEC | DRM_RDWR, &bo->fd)) {
-		GBM_DEBUG("%s: %s: drmPrimeHandleToFD() failed. %s\n", __FILE__, __func__, strerror(errno));
-		goto error;
+	if (!bo->addr) {
+		errno = EFAULT;
+		return -1;
 	}
 
-	// Map to the user space for bo_write
-	if (usage & (uint32_t)GBM_BO_USE_WRITE) {
-		ret = gbm_kms_bo_map_ref(bo);
-		if (ret) {
-			errno = -ret;
-			goto error;
-		}
+	if (count > bo->size) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	return (struct gbm_bo*)bo;
+	if (dev->upload.parallel_min && count >= dev->upload.parallel_min) {
+		if (!(upload = gbm_kms_upload_new_linear(bo, buf, count)))
+			return -1;
+		return gbm_kms_upload_submit(dev, upload, NULL, NULL);
+	}
 
- error:
-	GBM_DEBUG("%s: %s: %d: ERROR!!!!\n", __FILE__, __func__, __LINE__);
-	gbm_kms_bo_destroy((struct gbm_bo*)bo);
-	return NULL;
+	gbm_kms_bo_wait_uploads(bo);
+	gbm_kms_bo_wait_fences(bo, GBM_BO_TRANSFER_WRITE);
+	gbm_kms_bo_sync(bo, GBM_BO_TRANSFER_WRITE, false);
+	gbm_kms_copy_rect(bo->addr, count, buf, count, count, 1);
+	gbm_kms_bo_sync(bo, GBM_BO_TRANSFER_WRITE, true);
+
+	return 0;
 }
 
-static void *gbm_kms_bo_map(struct gbm_bo *_bo, uint32_t x, uint32_t y,
-			    uint32_t width, uint32_t height, uint32_t flags,
-			    uint32_t *stride, void **map_data)
+static int gbm_kms_bo_write_rect(struct gbm_bo *_bo, const void *buf,
+				 uint32_t src_format, uint32_t src_stride,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height)
 {
 	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_upload *upload;
+	uint32_t cpp = gbm_bo_get_bpp(_bo) / 8;
+	uint32_t src_cpp = cpp;
+	uint8_t *dst;
 	int ret;
 
-	if (x != 0 || y != 0 ||
-	    width != bo->base.width || height != bo->base.height) {
+	if (x >= bo->base.width || width > bo->base.width - x ||
+	    y >= bo->base.height || height > bo->base.height - y) {
 		errno = EINVAL;
-		return NULL;
+		return -1;
+	}
+
+	if (src_format == bo->base.format)
+		src_format = 0;
+	if (src_format) {
+		if (!gbm_kms_can_convert(src_format, bo->base.format)) {
+			errno = EINVAL;
+			return -1;
+		}
+		src_cpp = _gbm_format_get_bpp(src_format) / 8;
+	}
+
+	// only the first plane of packed formats is addressed in pixels
+	if (!cpp || src_stride < width * src_cpp) {
+		errno = EINVAL;
+		return -1;
 	}
 
 	ret = gbm_kms_bo_map_ref(bo);
 	if (ret < 0) {
 		errno = -ret;
-		return NULL;
+		return -1;
 	}
 
-	*map_data = bo->addr;
-	*stride = bo->base.stride;
-	return *map_data;
+	dst = (uint8_t*)bo->addr + y * bo->base.stride + x * cpp;
+
+	if (dev->upload.parallel_min &&
+	    (size_t)width * cpp * height >= dev->upload.parallel_min &&
+	    (upload = calloc(1, sizeof(struct gbm_kms_upload)))) {
+		// takes over the map reference
+		upload->bo = bo;
+		upload->dst = dst;
+		upload->dst_stride = bo->base.stride;
+		upload->src = buf;
+		upload->src_stride = src_stride;
+		upload->src_format = src_format;
+		upload->row_bytes = width * cpp;
+		upload->width = width;
+		upload->rows = height;
+		return gbm_kms_upload_submit(dev, upload, NULL, NULL);
+	}
+
+	gbm_kms_bo_wait_uploads(bo);
+	gbm_kms_bo_wait_fences(bo, GBM_BO_TRANSFER_WRITE);
+	gbm_kms_bo_sync(bo, GBM_BO_TRANSFER_WRITE, false);
+	if (src_format)
+		gbm_kms_convert_rect(dst, bo->base.stride, bo->base.format,
+				     buf, src_stride, src_format, width, height);
+	else
+		gbm_kms_copy_rect(dst, bo->base.stride, buf, src_stride,
+				  width * cpp, height);
+	gbm_kms_bo_sync(bo, GBM_BO_TRANSFER_WRITE, true);
+
+	gbm_kms_bo_map_unref(bo);
+
+	return 0;
 }
 
-static void gbm_kms_bo_unmap(struct gbm_bo *_bo, void *map_data)
+static int gbm_kms_bo_write_async(struct gbm_bo *_bo, const void *buf,
+				  size_t count, gbm_bo_write_done_func done,
+				  void *data)
 {
 	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	struct gbm_kms_upload *upload;
 
-	if (!map_data || map_data != bo->addr)
-		return;
+	if (count > bo->size) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	gbm_kms_bo_map_unref(bo);
+	if (!count) {
+		done(_bo, 0, data);
+		return 0;
+	}
+
+	if (!(upload = gbm_kms_upload_new_linear(bo, buf, count)))
+		return -1;
+
+	if (gbm_kms_upload_submit(dev, upload, done, data)) {
+		gbm_kms_bo_map_unref(bo);
+		free(upload);
+		return -1;
+	}
+
+	return 0;
 }
 
-static int gbm_kms_bo_write(struct gbm_bo *_bo, const void *buf, size_t count)
+/*
+ * Returns the DMA-BUF FD of the given plane, exporting it on first use.
+ * The FD stays owned by the BO and is closed when the BO is freed.
+ */
+static int gbm_kms_bo_export_plane_locked(struct gbm_kms_bo *bo, int plane)
 {
-	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
+	uint32_t handle;
+	uint64_t start;
+	int *fd;
+	int ret;
 
-	if (!bo->addr) {
-		errno = EFAULT;
+	if (plane == 0 || bo->planes[plane].handle == bo->planes[0].handle) {
+		handle = bo->base.handle.u32;
+		fd = &bo->fd;
+	} else {
+		handle = bo->planes[plane].handle;
+		fd = &bo->plane_fds[plane];
+	}
+
+	if (*fd >= 0)
+		return *fd;
+
+	GBM_KMS_STAT_INC(dev, prime_exports);
+	start = _gbm_trace_begin(&dev->base);
+	ret = drmPrimeHandleToFD(dev->base.fd, handle, DRM_CLOEXEC | DRM_RDWR,
+				 fd);
+	_gbm_trace_end(&dev->base, GBM_TRACE_PRIME_EXPORT, start);
+	if (ret) {
+		GBM_DEBUG("%s: %s: drmPrimeHandleToFD() failed. %s\n",
+			  __FILE__, __func__, strerror(errno));
+		*fd = -1;
 		return -1;
 	}
 
-	if (count > bo->size) {
+	return *fd;
+}
+
+static int gbm_kms_bo_borrow_plane_fd(struct gbm_bo *_bo, int plane)
+{
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+	int fd;
+
+	if (plane < 0 || bo->num_planes <= plane) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	memcpy(bo->addr, buf, count);
+	pthread_mutex_lock(&bo->lock);
+	fd = gbm_kms_bo_export_plane_locked(bo, plane);
+	pthread_mutex_unlock(&bo->lock);
 
-	return 0;
+	return fd;
 }
 
-static int gbm_kms_bo_get_fd(struct gbm_bo *_bo)
+static int gbm_kms_bo_get_plane_fd(struct gbm_bo *_bo, int plane)
 {
-	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
-	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
-	int ret, fd;
+	int fd = gbm_kms_bo_borrow_plane_fd(_bo, plane);
 
-	ret = drmPrimeHandleToFD(dev->base.fd, bo->base.handle.u32,
-				 DRM_CLOEXEC | DRM_RDWR, &fd);
-	if (ret < 0)
-		return ret;
+	if (fd < 0)
+		return -1;
 
-	return fd;
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static int gbm_kms_bo_get_fd(struct gbm_bo *_bo)
+{
+	return gbm_kms_bo_get_plane_fd(_bo, 0);
 }
 
 static int gbm_kms_bo_get_planes(struct gbm_bo *_bo)
@@ -349,7 +2870,14 @@ static uint32_t gbm_kms_bo_get_stride(struct gbm_bo *_bo, int plane)
 
 static uint32_t gbm_kms_bo_get_offset(struct gbm_bo *_bo, int plane)
 {
-	return 0;
+	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
+
+	if (plane < 0 || bo->num_planes <= plane) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	return bo->offsets[plane];
 }
 
 static union gbm_bo_handle gbm_kms_bo_get_handle(struct gbm_bo *_bo, int plane)
@@ -368,57 +2896,104 @@ static union gbm_bo_handle gbm_kms_bo_get_handle(struct gbm_bo *_bo, int plane)
 	return ret;
 }
 
-static int gbm_kms_bo_get_plane_fd(struct gbm_bo *_bo, int plane)
+static uint64_t gbm_kms_bo_get_modifier(struct gbm_bo *_bo)
 {
 	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
-	struct gbm_kms_device *dev = (struct gbm_kms_device*)bo->base.gbm;
-	uint32_t handle = 0;
-	int ret, fd;
 
-	if (plane < 0 || bo->num_planes <= plane) {
-		errno = EINVAL;
-		return -1;
-	}
+	// buffers imported without a modifier are taken to be linear
+	if (bo->modifier == DRM_FORMAT_MOD_INVALID)
+		return DRM_FORMAT_MOD_LINEAR;
 
-	handle = (bo->num_planes == 1) ?
-		bo->base.handle.u32 : bo->planes[plane].handle;
+	return bo->modifier;
+}
 
-	ret = drmPrimeHandleToFD(dev->base.fd, handle, DRM_CLOEXEC | DRM_RDWR,
-				 &fd);
-	if (ret < 0)
-		return -1;
+/*
+ * wl_buffer imports
+ *
+ * Compositors import the same few buffers of each client over and over.
+ * The first import binds a BO to the wl_buffer, holding a reference of
+ * its own, and later imports return that BO until the client destroys the
+ * buffer. Like everything else that touches a wl_resource, this only
+ * happens on the display thread, which is why the device list needs no
+ * lock.
+ *
+ * All imports of a wl_buffer share one user reference besides the one of
+ * the binding, just as they share the user data. A compositor keeping a
+ * refcounted FB in the user data destroys the BO once, when the FB goes
+ * away, and the BO stays around for the next import as long as the
+ * client's buffer does. Destroying it more often than that does no harm.
+ */
+static void gbm_kms_wl_buffer_unbind(struct gbm_kms_bo *bo)
+{
+	wl_list_remove(&bo->wl_destroy.link);
+	wl_list_remove(&bo->wl_link);
+	wl_list_init(&bo->wl_link);
 
-	return fd;
+	pthread_mutex_lock(&bo->lock);
+	bo->wl_bound = false;
+	pthread_mutex_unlock(&bo->lock);
+
+	// drop the reference of the binding
+	gbm_bo_destroy(&bo->base);
 }
 
-static uint64_t gbm_kms_bo_get_modifier(struct gbm_bo *_bo)
+static void gbm_kms_wl_buffer_destroy(struct wl_listener *listener,
+				      void *data)
+{
+	struct gbm_kms_bo *bo = wl_container_of(listener, bo, wl_destroy);
+
+	gbm_kms_wl_buffer_unbind(bo);
+}
+
+static void gbm_kms_wl_buffers_unbind(struct gbm_kms_device *dev)
 {
-	return DRM_FORMAT_MOD_LINEAR;
+	struct gbm_kms_bo *bo, *tmp;
+
+	wl_list_for_each_safe(bo, tmp, &dev->wl_buffers, wl_link)
+		gbm_kms_wl_buffer_unbind(bo);
 }
 
 static struct gbm_kms_bo* gbm_kms_import_wl_buffer(struct gbm_device *gbm,
 						   void *_buffer)
 {
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
+	struct wl_resource *resource = _buffer;
 	struct wl_kms_buffer *buffer;
+	struct wl_listener *listener;
 	struct gbm_kms_bo *bo;
 
-	buffer = wayland_kms_buffer_get((struct wl_resource*)_buffer);
+	listener = wl_resource_get_destroy_listener(resource,
+						    gbm_kms_wl_buffer_destroy);
+	if (listener) {
+		bo = wl_container_of(listener, bo, wl_destroy);
+
+		// bound by another device, import it without binding
+		if (bo->base.gbm == gbm) {
+			pthread_mutex_lock(&bo->lock);
+			// unless the user still holds it from an earlier import
+			if (bo->refcount == 1)
+				bo->refcount++;
+			pthread_mutex_unlock(&bo->lock);
+			return bo;
+		}
+	}
+
+	buffer = wayland_kms_buffer_get(resource);
 	if (!buffer) {
 		errno = EINVAL;
 		return NULL;
 	}
 
 	// XXX: BO handle is imported in wayland-kms.
-	if (!(bo = calloc(1, sizeof(struct gbm_kms_bo))))
+	if (!(bo = gbm_kms_bo_new(gbm)))
 		return NULL;
 
-	bo->base.gbm = gbm;
-
 	bo->base.width = buffer->width;
 	bo->base.height = buffer->height;
 	bo->base.format = buffer->format;
 	bo->base.stride = buffer->stride;
 	bo->base.handle.u32 = buffer->handle;
+	bo->size = buffer->stride * buffer->height;
 
 	if (buffer->num_planes > 0 && buffer->num_planes <= MAX_PLANES) {
 		int i;
@@ -431,7 +3006,92 @@ static struct gbm_kms_bo* gbm_kms_import_wl_buffer(struct gbm_device *gbm,
 		bo->num_planes = 1;
 	}
 
+	if (!listener) {
+		bo->wl_bound = true;
+		bo->refcount++;
+		bo->wl_destroy.notify = gbm_kms_wl_buffer_destroy;
+		wl_resource_add_destroy_listener(resource, &bo->wl_destroy);
+		wl_list_insert(&dev->wl_buffers, &bo->wl_link);
+	}
+
+	gbm_kms_stats_account(bo, true);
+	GBM_KMS_STAT_INC(dev, bo_imported);
+	return bo;
+}
+
+/*
+ * Returns a new BO set up after desc, sharing the handles with any other
+ * BO of the same buffer. Only the handles are reference counted; nothing
+ * is looked up or cached, so every import still costs a
+ * drmPrimeFDToHandle() per plane and a new BO, with its own user data and
+ * its own gbm_bo_destroy(), as callers expect.
+ *
+ * Must be called with close_lock held for reading, taken before the handles
+ * in desc were obtained. The lock is released on return.
+ */
+static struct gbm_kms_bo *gbm_kms_import_handles(struct gbm_kms_device *dev,
+						 const struct gbm_kms_bo *desc)
+{
+	struct gbm_kms_import_table *table = &dev->imports;
+	struct gbm_kms_bo *bo;
+	int i;
+
+	if (!(bo = gbm_kms_bo_new(&dev->base)))
+		goto error;
+
+	for (i = 0; i < desc->num_planes; i++) {
+		if (gbm_kms_handle_ref(table, desc->planes[i].handle))
+			goto error_ref;
+	}
+
+	bo->base.width = desc->base.width;
+	bo->base.height = desc->base.height;
+	bo->base.format = desc->base.format;
+	bo->base.stride = desc->planes[0].stride;
+	bo->base.handle.u32 = desc->planes[0].handle;
+	bo->modifier = desc->modifier;
+	bo->allocated_handle = true;
+	if (desc->num_planes == 1)
+		bo->size = desc->planes[0].stride * desc->base.height;
+
+	bo->num_planes = desc->num_planes;
+	for (i = 0; i < desc->num_planes; i++)  {
+		bo->planes[i].handle = desc->planes[i].handle;
+		bo->planes[i].stride = desc->planes[i].stride;
+		bo->offsets[i] = desc->offsets[i];
+	}
+
+	gbm_kms_stats_account(bo, true);
+	GBM_KMS_STAT_INC(dev, bo_imported);
+
+	pthread_rwlock_unlock(&table->close_lock);
 	return bo;
+
+ error_ref:
+	while (i--)
+		gbm_kms_handle_unref(table, desc->planes[i].handle);
+	gbm_kms_bo_delete(bo);
+ error:
+	pthread_rwlock_unlock(&table->close_lock);
+
+	// close what we have just got, unless another BO holds it. Closing
+	// needs the lock exclusively, as a concurrent import may have been
+	// handed the very same handle.
+	pthread_rwlock_wrlock(&table->close_lock);
+	for (i = 0; i < desc->num_planes; i++) {
+		uint32_t handle = desc->planes[i].handle;
+		int j;
+
+		for (j = 0; j < i; j++) {
+			if (desc->planes[j].handle == handle)
+				break;
+		}
+
+		if (j == i && !gbm_kms_handle_is_used(table, handle))
+			gbm_kms_bo_close_handle(dev->base.fd, handle);
+	}
+	pthread_rwlock_unlock(&table->close_lock);
+	return NULL;
 }
 
 static struct gbm_kms_bo* gbm_kms_import_fd(struct gbm_device *gbm,
@@ -439,29 +3099,25 @@ static struct gbm_kms_bo* gbm_kms_import_fd(struct gbm_device *gbm,
 {
 	struct gbm_import_fd_data *fd_data = _buffer;
 	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
-	struct gbm_kms_bo *bo;
-	uint32_t handle;
+	struct gbm_kms_bo desc = { 0 };
 
-	if (drmPrimeFDToHandle(dev->base.fd, fd_data->fd, &handle)) {
+	pthread_rwlock_rdlock(&dev->imports.close_lock);
+	if (gbm_kms_prime_fd_to_handle(dev, fd_data->fd,
+				       &desc.planes[0].handle)) {
 		GBM_DEBUG("%s: %s: drmPrimeFDToHandle() failed. %s\n",
 			  __FILE__, __func__, strerror(errno));
+		pthread_rwlock_unlock(&dev->imports.close_lock);
 		return NULL;
 	}
 
-	// XXX: BO handle is imported in wayland-kms.
-	if (!(bo = calloc(1, sizeof(struct gbm_kms_bo))))
-		return NULL;
-
-	bo->base.gbm = gbm;
-	bo->base.width = fd_data->width;
-	bo->base.height = fd_data->height;
-	bo->base.format = gbm_format_canonicalize(fd_data->format);
-	bo->base.stride = fd_data->stride;
-	bo->base.handle.u32 = handle;
-	bo->num_planes = 1;
-	bo->allocated_handle = true;
+	desc.base.width = fd_data->width;
+	desc.base.height = fd_data->height;
+	desc.base.format = gbm_format_canonicalize(fd_data->format);
+	desc.modifier = DRM_FORMAT_MOD_INVALID;
+	desc.num_planes = 1;
+	desc.planes[0].stride = fd_data->stride;
 
-	return bo;
+	return gbm_kms_import_handles(dev, &desc);
 }
 
 static struct gbm_kms_bo *gbm_kms_import_fd_modifier(struct gbm_device *gbm,
@@ -469,12 +3125,12 @@ static struct gbm_kms_bo *gbm_kms_import_fd_modifier(struct gbm_device *gbm,
 {
 	struct gbm_import_fd_modifier_data *fd_data = _buffer;
 	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
-	struct gbm_kms_bo *bo;
-	uint32_t handle[MAX_PLANES];
-	int i, num_planes;
+	struct gbm_kms_bo desc = { 0 };
+	int i;
 
-	if (fd_data->modifier != DRM_FORMAT_MOD_LINEAR &&
-	    fd_data->modifier != DRM_FORMAT_MOD_INVALID) {
+	if (fd_data->modifier != DRM_FORMAT_MOD_INVALID &&
+	    !gbm_kms_is_modifier_supported(dev, fd_data->format,
+					   fd_data->modifier)) {
 		errno = EINVAL;
 		return NULL;
 	}
@@ -484,34 +3140,26 @@ static struct gbm_kms_bo *gbm_kms_import_fd_modifier(struct gbm_device *gbm,
 		return NULL;
 	}
 
+	pthread_rwlock_rdlock(&dev->imports.close_lock);
 	for (i = 0; i < fd_data->num_fds; i++) {
-		if (drmPrimeFDToHandle(dev->base.fd, fd_data->fds[i],
-				       &handle[i])) {
+		if (gbm_kms_prime_fd_to_handle(dev, fd_data->fds[i],
+					       &desc.planes[i].handle)) {
 			GBM_DEBUG("%s: %s: drmPrimeFDToHandle() failed. %s\n",
 				  __FILE__, __func__, strerror(errno));
+			pthread_rwlock_unlock(&dev->imports.close_lock);
 			return NULL;
 		}
+		desc.planes[i].stride = fd_data->strides[i];
+		desc.offsets[i] = fd_data->offsets[i];
 	}
 
-	if (!(bo = calloc(1, sizeof(struct gbm_kms_bo))))
-		return NULL;
-
-	bo->base.gbm = gbm;
-
-	bo->base.width = fd_data->width;
-	bo->base.height = fd_data->height;
-	bo->base.format = gbm_format_canonicalize(fd_data->format);
-	bo->base.stride = fd_data->strides[0];
-	bo->base.handle.u32 = handle[0];
-	bo->allocated_handle = true;
-
-	bo->num_planes = fd_data->num_fds;
-	for (i = 0; i < fd_data->num_fds; i++)  {
-		bo->planes[i].handle = handle[i];
-		bo->planes[i].stride = fd_data->strides[i];
-	}
+	desc.base.width = fd_data->width;
+	desc.base.height = fd_data->height;
+	desc.base.format = gbm_format_canonicalize(fd_data->format);
+	desc.modifier = fd_data->modifier;
+	desc.num_planes = fd_data->num_fds;
 
-	return bo;
+	return gbm_kms_import_handles(dev, &desc);
 }
 
 static struct gbm_bo *gbm_kms_bo_import(struct gbm_device *gbm,
@@ -549,32 +3197,42 @@ static struct gbm_bo *gbm_kms_bo_import(struct gbm_device *gbm,
 
 static int gbm_kms_surface_set_bo(struct gbm_kms_surface *surface, int n, void *addr, int fd, uint32_t stride)
 {
-	struct gbm_kms_bo *bo;
+	struct gbm_kms_bo *bo, *old;
 
-	if (n < 0 || n > 1)
+	if (n < 0 || n >= surface->num_bufs)
 		return -1;
 
-	if (surface->bo[n])
-		free(surface->bo[n]);
+	// nothing to clear or replace in BOs we own
+	if (surface->allocated)
+		return (addr == NULL && stride == 0) ? 0 : -1;
+
+	pthread_mutex_lock(&surface->lock);
+	old = surface->bo[n];
+	surface->bo[n] = NULL;
+	pthread_mutex_unlock(&surface->lock);
+	if (old)
+		gbm_kms_bo_delete(old);
 
 	if (addr == NULL && stride == 0)
 		return 0;
 
-	if (!(bo = calloc(1, sizeof(struct gbm_kms_bo))))
+	if (!(bo = gbm_kms_bo_new(surface->base.gbm)))
 		return -1;
 
-	bo->base.gbm = surface->base.gbm;
 	bo->base.width = surface->base.width;
 	bo->base.height = surface->base.height;
 	bo->base.format = surface->base.format;
 	bo->base.stride = stride;
 	bo->size = stride * surface->base.height;
 	bo->addr = addr;
+	bo->map_external = true;
 	bo->fd = fd;
 	bo->num_planes = 1;
 	bo->allocated = false;
 
+	pthread_mutex_lock(&surface->lock);
 	surface->bo[n] = bo;
+	pthread_mutex_unlock(&surface->lock);
 
 	return 0;
 }
@@ -589,10 +3247,23 @@ static struct gbm_surface *gbm_kms_surface_create(struct gbm_device *gbm,
 						  const uint64_t *modifiers,
 						  const unsigned count)
 {
+	struct gbm_kms_device *dev = (struct gbm_kms_device*)gbm;
 	struct gbm_kms_surface *surface;
+	int num_bufs;
 	GBM_DEBUG("%s: %s: %d\n", __FILE__, __func__, __LINE__);
 
-	if (!(surface = calloc(1, sizeof(struct gbm_kms_surface))))
+	// GBM_KMS_SURFACE_BUFFERS is only the default
+	num_bufs = (flags & GBM_SURFACE_BUFFERS_MASK) >>
+		GBM_SURFACE_BUFFERS_SHIFT;
+	flags &= ~GBM_SURFACE_BUFFERS_MASK;
+	if (!num_bufs)
+		num_bufs = dev->surface_buffers;
+	else if (num_bufs < 2)
+		num_bufs = 2;
+	else if (num_bufs > MAX_SURFACE_BUFFERS)
+		num_bufs = MAX_SURFACE_BUFFERS;
+
+	if (!(surface = gbm_kms_slab_alloc(&dev->surface_slab)))
 		return NULL;
 
 	surface->base.gbm = gbm;
@@ -600,22 +3271,70 @@ static struct gbm_surface *gbm_kms_surface_create(struct gbm_device *gbm,
 	surface->base.height = height;
 	surface->base.format = format;
 	surface->base.flags = flags;
+	pthread_mutex_init(&surface->lock, NULL);
 
 	GBM_DEBUG("%s: %s: %d: created surface %dx%d\n", __FILE__, __func__, __LINE__, width, height);
+	surface->num_bufs = num_bufs;
 	surface->front = -1;
 	surface->set_bo = gbm_kms_surface_set_bo;
 
+	// starts out readable, as every buffer is free
+	surface->release_fd = eventfd(1, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (surface->release_fd < 0)
+		goto error;
+
+	if (dev->surface_alloc) {
+		int i;
+
+		surface->allocated = true;
+		for (i = 0; i < surface->num_bufs; i++) {
+			struct gbm_kms_bo *bo;
+
+			bo = (struct gbm_kms_bo*)gbm_kms_bo_create(gbm, width,
+					height, format,
+					flags | GBM_BO_USE_SCANOUT,
+					modifiers, count);
+			if (!bo)
+				goto error;
+			surface->bo[i] = bo;
+
+			// the GL stack renders through this mapping
+			bo->map_persistent = true;
+			if (gbm_kms_bo_map_ref(bo))
+				goto error;
+		}
+	}
+
 	return (struct gbm_surface*)surface;
+
+ error:
+	gbm_kms_surface_destroy((struct gbm_surface*)surface);
+	return NULL;
 }
 
 static void gbm_kms_surface_destroy(struct gbm_surface *_surface)
 {
 	struct gbm_kms_surface *surface = (struct gbm_kms_surface*)_surface;
+	struct gbm_kms_device *dev;
+	int i;
 
 	if (!surface)
 		return;
+	dev = (struct gbm_kms_device*)surface->base.gbm;
+
+	for (i = 0; i < surface->num_bufs; i++) {
+		if (!surface->bo[i])
+			continue;
+		if (!surface->allocated)
+			gbm_kms_bo_delete(surface->bo[i]);
+		else
+			gbm_bo_destroy(&surface->bo[i]->base);
+	}
 
-	free(surface);
+	if (surface->release_fd >= 0)
+		close(surface->release_fd);
+	pthread_mutex_destroy(&surface->lock);
+	gbm_kms_slab_free(&dev->surface_slab, surface);
 }
 
 static struct gbm_bo *gbm_kms_surface_lock_front_buffer(struct gbm_surface *_surface)
@@ -630,59 +3349,169 @@ static struct gbm_bo *gbm_kms_surface_lock_front_buffer(struct gbm_surface *_sur
 	 * drmModeAddFB2().
 	 */
 
-	if (surface->front >= 0) {
-		struct gbm_kms_bo *front = surface->bo[surface->front];
-		front->locked = 1;
-		return (struct gbm_bo*)front;
+	struct gbm_kms_bo *front = NULL;
+	int n;
+
+	pthread_mutex_lock(&surface->lock);
+	n = gbm_kms_get_front(surface);
+	if (n >= 0 && n < surface->num_bufs && surface->bo[n]) {
+		front = surface->bo[n];
+		__atomic_store_n(&front->locked, 1, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&surface->lock);
 
-	return NULL;
+	return (struct gbm_bo*)front;
 }
 
 static void gbm_kms_surface_release_buffer(struct gbm_surface *_surface, struct gbm_bo *_bo)
 {
+	struct gbm_kms_surface *surface = (struct gbm_kms_surface*)_surface;
 	struct gbm_kms_bo *bo = (struct gbm_kms_bo*)_bo;
-	bo->locked = 0;
+	__atomic_store_n(&bo->locked, 0, __ATOMIC_RELEASE);
+
+	// wake up pollers; this only fails if the counter would overflow,
+	// in which case the eventfd is readable anyway
+	eventfd_write(surface->release_fd, 1);
 	return;
 }
 
 static int gbm_kms_surface_has_free_buffers(struct gbm_surface *_surface)
 {
 	struct gbm_kms_surface *surface = (struct gbm_kms_surface*)_surface;
-	return ((!surface->bo[0]->locked) || (!surface->bo[1]->locked));
+	int i, ret = 0;
+
+	pthread_mutex_lock(&surface->lock);
+	// a slot the GL stack has not filled yet is free as well
+	for (i = 0; i < surface->num_bufs; i++) {
+		if (!surface->bo[i] || !gbm_kms_is_bo_locked(surface->bo[i])) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&surface->lock);
+
+	return ret;
+}
+
+static int gbm_kms_surface_get_release_fd(struct gbm_surface *_surface)
+{
+	struct gbm_kms_surface *surface = (struct gbm_kms_surface*)_surface;
+	return surface->release_fd;
+}
+
+static struct gbm_bo *gbm_kms_surface_try_acquire_buffer(struct gbm_surface *_surface)
+{
+	struct gbm_kms_surface *surface = (struct gbm_kms_surface*)_surface;
+	struct gbm_kms_bo *bo = NULL;
+	eventfd_t count;
+	int i, n, front, free = 0;
+
+	pthread_mutex_lock(&surface->lock);
+
+	// Drain before scanning: a release racing with the scan writes to
+	// the eventfd again, so the wakeup is never lost.
+	eventfd_read(surface->release_fd, &count);
+
+	// hand out buffers round robin, starting after the front buffer
+	front = gbm_kms_get_front(surface);
+	for (i = 1; i <= surface->num_bufs; i++) {
+		n = (front + i) % surface->num_bufs;
+		if (n < 0 || n == front || !surface->bo[n] ||
+		    gbm_kms_is_bo_locked(surface->bo[n]))
+			continue;
+		if (!bo)
+			bo = surface->bo[n];
+		free++;
+	}
+
+	// the buffer returned isn't reserved, so it keeps the eventfd
+	// readable as well
+	if (free)
+		eventfd_write(surface->release_fd, 1);
+
+	pthread_mutex_unlock(&surface->lock);
+
+	if (!bo)
+		errno = EAGAIN;
+
+	return (struct gbm_bo*)bo;
 }
 
 struct gbm_device kms_gbm_device = {
 	.name = "kms",
 
 	.destroy = gbm_kms_destroy,
+	.flush_cache = gbm_kms_flush_cache,
+	.set_memory_budget = gbm_kms_set_memory_budget,
+	.trim_cache = gbm_kms_trim_cache,
+	.get_stats = gbm_kms_get_stats,
+	.get_format_stats = gbm_kms_get_format_stats,
+	.dump_bos = gbm_kms_dump_bos,
 	.is_format_supported = gbm_kms_is_format_supported,
 	.get_format_modifier_plane_count = gbm_kms_get_format_modifier_plane_count,
 
 	.bo_create = gbm_kms_bo_create,
+	.bo_create_array = gbm_kms_bo_create_array,
 	.bo_import = gbm_kms_bo_import,
 	.bo_map = gbm_kms_bo_map,
 	.bo_unmap = gbm_kms_bo_unmap,
 	.bo_write = gbm_kms_bo_write,
+	.bo_write_rect = gbm_kms_bo_write_rect,
+	.bo_write_async = gbm_kms_bo_write_async,
+	.bo_set_fence = gbm_kms_bo_set_fence,
+	.bo_get_fence = gbm_kms_bo_get_fence,
 	.bo_get_fd = gbm_kms_bo_get_fd,
 	.bo_get_planes = gbm_kms_bo_get_planes,
 	.bo_get_handle = gbm_kms_bo_get_handle,
 	.bo_get_plane_fd = gbm_kms_bo_get_plane_fd,
+	.bo_borrow_plane_fd = gbm_kms_bo_borrow_plane_fd,
 	.bo_get_stride = gbm_kms_bo_get_stride,
 	.bo_get_offset = gbm_kms_bo_get_offset,
 	.bo_get_modifier = gbm_kms_bo_get_modifier,
+	.bo_unref = gbm_kms_bo_unref,
 	.bo_destroy = gbm_kms_bo_destroy,
 
 	.surface_create = gbm_kms_surface_create,
 	.surface_lock_front_buffer = gbm_kms_surface_lock_front_buffer,
 	.surface_release_buffer = gbm_kms_surface_release_buffer,
 	.surface_has_free_buffers = gbm_kms_surface_has_free_buffers,
+	.surface_get_release_fd = gbm_kms_surface_get_release_fd,
+	.surface_try_acquire_buffer = gbm_kms_surface_try_acquire_buffer,
 	.surface_destroy = gbm_kms_surface_destroy,
 };
 
+/*
+ * Open the primary node of the DRM device the render node fd belongs to.
+ * Creating dumb buffers needs no DRM master, so any process that may open
+ * the node can allocate there.
+ */
+static int gbm_kms_open_primary(int fd)
+{
+	struct gbm_device_identity id;
+	struct stat buf;
+	int primary;
+
+	if (fstat(fd, &buf) < 0)
+		return -1;
+
+	_gbm_device_identity_init(&id, fd, &buf);
+	if (!id.primary_node[0]) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	primary = open(id.primary_node, O_RDWR | O_CLOEXEC);
+	if (primary < 0)
+		GBM_DEBUG("%s: %s: can't open %s. %s\n", __FILE__, __func__,
+			  id.primary_node, strerror(errno));
+
+	return primary;
+}
+
 static struct gbm_device *kms_device_create(int fd)
 {
 	struct gbm_kms_device *dev;
+	uint64_t cap;
 
 	GBM_DEBUG("%s: %d\n", __func__, __LINE__);
 
@@ -691,12 +3520,42 @@ static struct gbm_device *kms_device_create(int fd)
 
 	dev->base = kms_gbm_device;
 	dev->base.fd = fd;
+	dev->alloc_fd = fd;
+
+	if (drmGetNodeTypeFromFd(fd) == DRM_NODE_RENDER &&
+	    (dev->alloc_fd = gbm_kms_open_primary(fd)) < 0) {
+		free(dev);
+		return NULL;
+	}
 
-	if (kms_create(fd, &dev->kms)) {
+	if (drmGetCap(dev->alloc_fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap) {
+		if (dev->alloc_fd != fd)
+			close(dev->alloc_fd);
 		free(dev);
 		return NULL;
 	}
 
+	dev->persistent_map = gbm_kms_getenv_ulong("GBM_KMS_PERSISTENT_MAP", 0);
+	dev->surface_alloc = gbm_kms_getenv_ulong("GBM_KMS_SURFACE_ALLOC", 0);
+	dev->surface_buffers = gbm_kms_getenv_ulong("GBM_KMS_SURFACE_BUFFERS", 2);
+	if (dev->surface_buffers < 2)
+		dev->surface_buffers = 2;
+	else if (dev->surface_buffers > MAX_SURFACE_BUFFERS)
+		dev->surface_buffers = MAX_SURFACE_BUFFERS;
+
+	pthread_mutex_init(&dev->modifiers_lock, NULL);
+	pthread_mutex_init(&dev->stats.lock, NULL);
+	gbm_kms_registry_init(&dev->registry);
+	gbm_kms_slab_init(&dev->bo_slab, sizeof(struct gbm_kms_bo));
+	gbm_kms_slab_init(&dev->surface_slab, sizeof(struct gbm_kms_surface));
+	gbm_kms_bo_cache_init(&dev->cache);
+	gbm_kms_import_table_init(&dev->imports);
+	gbm_kms_cursor_pool_init(dev);
+	gbm_kms_suballoc_init(dev);
+	gbm_kms_upload_pool_init(&dev->upload);
+	gbm_kms_pressure_init(dev);
+	wl_list_init(&dev->wl_buffers);
+
 	return &dev->base;
 }
 
@@ -25,13 +25,30 @@
  *    Benjamin Franzke <benjaminfranzke@googlemail.com>
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <dirent.h>
 
+#ifdef HAVE_LIBUDEV
 #include <libudev.h>
+#endif
 #include <sys/types.h>
+#ifdef MAJOR_IN_MKDEV
+#include <sys/mkdev.h>
+#endif
+#ifdef MAJOR_IN_SYSMACROS
+#include <sys/sysmacros.h>
+#endif
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
+#include <drm.h>
 
 #include "common.h"
 #include "gbmint.h"
@@ -39,47 +56,114 @@
 GBM_EXPORT struct udev_device *
 _gbm_udev_device_new_from_fd(struct udev *udev, int fd)
 {
+#ifdef HAVE_LIBUDEV
    struct udev_device *device;
    struct stat buf;
 
    if (fstat(fd, &buf) < 0) {
-      fprintf(stderr, "gbm: failed to stat fd %d", fd);
+      fprintf(stderr, "gbm: failed to stat fd %d\n", fd);
       return NULL;
    }
 
    device = udev_device_new_from_devnum(udev, 'c', buf.st_rdev);
    if (device == NULL) {
       fprintf(stderr,
-              "gbm: could not create udev device for fd %d", fd);
+              "gbm: could not create udev device for fd %d\n", fd);
       return NULL;
    }
 
    return device;
+#else
+   errno = ENOSYS;
+   return NULL;
+#endif
 }
 
-GBM_EXPORT char *
-_gbm_fd_get_device_name(int fd)
+/*
+ * Look up /dev/<DEVNAME> of a character device in its sysfs uevent file,
+ * which is what udev would tell us.
+ */
+static int
+sysfs_get_node(dev_t rdev, char *node, size_t size)
 {
-   struct udev *udev;
-   struct udev_device *device;
-   const char *const_device_name;
-   char *device_name = NULL;
+   char path[64], line[256];
+   int found = 0;
+   FILE *file;
 
-   udev = udev_new();
-   device = _gbm_udev_device_new_from_fd(udev, fd);
-   if (device == NULL)
-      return NULL;
+   snprintf(path, sizeof path, "/sys/dev/char/%u:%u/uevent",
+            major(rdev), minor(rdev));
+   if (!(file = fopen(path, "re")))
+      return -1;
+
+   while (fgets(line, sizeof line, file)) {
+      if (strncmp(line, "DEVNAME=", 8))
+         continue;
+      line[strcspn(line, "\n")] = '\0';
+      snprintf(node, size, "/dev/%s", line + 8);
+      found = 1;
+      break;
+   }
+   fclose(file);
 
-   const_device_name = udev_device_get_devnode(device);
-   if (!const_device_name)
-      goto out;
-   device_name = strdup(const_device_name);
+   return found ? 0 : -1;
+}
 
-out:
-   udev_device_unref(device);
-   udev_unref(udev);
+/*
+ * Find the primary and render nodes of the DRM device rdev belongs to.
+ * The minors of one device are all listed under its parent in sysfs.
+ */
+static void
+sysfs_get_siblings(dev_t rdev, struct gbm_device_identity *id)
+{
+   struct dirent *entry;
+   char path[64];
+   DIR *dir;
+
+   snprintf(path, sizeof path, "/sys/dev/char/%u:%u/device/drm",
+            major(rdev), minor(rdev));
+   if (!(dir = opendir(path)))
+      return;
+
+   while ((entry = readdir(dir))) {
+      if (!strncmp(entry->d_name, "card", 4))
+         snprintf(id->primary_node, sizeof id->primary_node,
+                  "/dev/dri/%s", entry->d_name);
+      else if (!strncmp(entry->d_name, "renderD", 7))
+         snprintf(id->render_node, sizeof id->render_node,
+                  "/dev/dri/%s", entry->d_name);
+   }
+   closedir(dir);
+}
+
+/* Name of the kernel driver behind fd, or an empty string */
+GBM_EXPORT void
+_gbm_fd_get_driver_name(int fd, char *name, size_t size)
+{
+   struct drm_version version;
+
+   memset(&version, 0, sizeof version);
+   version.name = name;
+   version.name_len = size - 1;
+
+   if (ioctl(fd, DRM_IOCTL_VERSION, &version))
+      version.name_len = 0;
+
+   name[version.name_len < size ? version.name_len : size - 1] = '\0';
+}
+
+/*
+ * Resolve everything that never changes for a device node once, so that
+ * it can be served from the gbm_device later on.
+ */
+GBM_EXPORT void
+_gbm_device_identity_init(struct gbm_device_identity *id, int fd,
+                          const struct stat *buf)
+{
+   memset(id, 0, sizeof *id);
 
-   return device_name;
+   sysfs_get_node(buf->st_rdev, id->node, sizeof id->node);
+   sysfs_get_siblings(buf->st_rdev, id);
+   _gbm_fd_get_driver_name(fd, id->driver, sizeof id->driver);
 }
 
 GBM_EXPORT void
@@ -28,13 +28,23 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
-#include <libudev.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
+struct udev;
+struct udev_device;
+struct gbm_device_identity;
+
+/* Returns NULL with errno set to ENOSYS when built without libudev */
 struct udev_device *
 _gbm_udev_device_new_from_fd(struct udev *udev, int fd);
 
-char *
-_gbm_fd_get_device_name(int fd);
+void
+_gbm_fd_get_driver_name(int fd, char *name, size_t size);
+
+void
+_gbm_device_identity_init(struct gbm_device_identity *id, int fd,
+                          const struct stat *buf);
 
 void
 _gbm_log(const char *fmt_str, ...);
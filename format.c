@@ -0,0 +1,161 @@
+/*
+ * Copyright © 2011 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+
+#include "gbm.h"
+#include "gbmint.h"
+
+/*
+ * The format descriptors live in a hash table that is laid out by the
+ * compiler: each entry is put into the slot its fourcc hashes to with a
+ * designated initializer, so a lookup is one multiplication and one
+ * compare. The multiplier has been picked so that none of the formats
+ * below collide. Adding a format that does collide makes the compiler
+ * complain about an initializer overriding another; pick a new
+ * multiplier then.
+ */
+#if defined(__GNUC__)
+#pragma GCC diagnostic error "-Woverride-init"
+#endif
+
+#define GBM_FORMAT_HASH_BITS  7
+#define GBM_FORMAT_HASH_MUL   0xa2abafefu
+
+#define GBM_FORMAT_SLOT(format) \
+   ((uint32_t)((format) * GBM_FORMAT_HASH_MUL) >> (32 - GBM_FORMAT_HASH_BITS))
+
+#define RGB(fmt, bits) \
+   [GBM_FORMAT_SLOT(fmt)] = { \
+      .format = fmt, .num_planes = 1, .bpp = bits, \
+      .cpp = { (bits) / 8 }, .hsub = 1, .vsub = 1, \
+   }
+
+/* Packed YCbCr is addressed like RGB, a macropixel counting as two */
+#define YUV_PACKED(fmt) \
+   [GBM_FORMAT_SLOT(fmt)] = { \
+      .format = fmt, .num_planes = 1, .bpp = 16, \
+      .cpp = { 2 }, .hsub = 1, .vsub = 1, \
+   }
+
+/* Planar YCbCr has no bpp; cpp is per sample of each plane */
+#define YUV_PLANAR(fmt, planes, cpp0, cpp1, cpp2, h, v) \
+   [GBM_FORMAT_SLOT(fmt)] = { \
+      .format = fmt, .num_planes = planes, .bpp = 0, \
+      .cpp = { cpp0, cpp1, cpp2 }, .hsub = h, .vsub = v, \
+   }
+
+static const struct gbm_format_desc formats[1 << GBM_FORMAT_HASH_BITS] = {
+   RGB(GBM_FORMAT_C8, 8),
+   RGB(GBM_FORMAT_R8, 8),
+   RGB(GBM_FORMAT_RGB332, 8),
+   RGB(GBM_FORMAT_BGR233, 8),
+
+   RGB(GBM_FORMAT_GR88, 16),
+   RGB(GBM_FORMAT_XRGB4444, 16),
+   RGB(GBM_FORMAT_XBGR4444, 16),
+   RGB(GBM_FORMAT_RGBX4444, 16),
+   RGB(GBM_FORMAT_BGRX4444, 16),
+   RGB(GBM_FORMAT_ARGB4444, 16),
+   RGB(GBM_FORMAT_ABGR4444, 16),
+   RGB(GBM_FORMAT_RGBA4444, 16),
+   RGB(GBM_FORMAT_BGRA4444, 16),
+   RGB(GBM_FORMAT_XRGB1555, 16),
+   RGB(GBM_FORMAT_XBGR1555, 16),
+   RGB(GBM_FORMAT_RGBX5551, 16),
+   RGB(GBM_FORMAT_BGRX5551, 16),
+   RGB(GBM_FORMAT_ARGB1555, 16),
+   RGB(GBM_FORMAT_ABGR1555, 16),
+   RGB(GBM_FORMAT_RGBA5551, 16),
+   RGB(GBM_FORMAT_BGRA5551, 16),
+   RGB(GBM_FORMAT_RGB565, 16),
+   RGB(GBM_FORMAT_BGR565, 16),
+
+   RGB(GBM_FORMAT_RGB888, 24),
+   RGB(GBM_FORMAT_BGR888, 24),
+
+   RGB(GBM_FORMAT_XRGB8888, 32),
+   RGB(GBM_FORMAT_XBGR8888, 32),
+   RGB(GBM_FORMAT_RGBX8888, 32),
+   RGB(GBM_FORMAT_BGRX8888, 32),
+   RGB(GBM_FORMAT_ARGB8888, 32),
+   RGB(GBM_FORMAT_ABGR8888, 32),
+   RGB(GBM_FORMAT_RGBA8888, 32),
+   RGB(GBM_FORMAT_BGRA8888, 32),
+   RGB(GBM_FORMAT_XRGB2101010, 32),
+   RGB(GBM_FORMAT_XBGR2101010, 32),
+   RGB(GBM_FORMAT_RGBX1010102, 32),
+   RGB(GBM_FORMAT_BGRX1010102, 32),
+   RGB(GBM_FORMAT_ARGB2101010, 32),
+   RGB(GBM_FORMAT_ABGR2101010, 32),
+   RGB(GBM_FORMAT_RGBA1010102, 32),
+   RGB(GBM_FORMAT_BGRA1010102, 32),
+
+   RGB(GBM_FORMAT_XBGR16161616F, 64),
+   RGB(GBM_FORMAT_ABGR16161616F, 64),
+
+   YUV_PACKED(GBM_FORMAT_YUYV),
+   YUV_PACKED(GBM_FORMAT_YVYU),
+   YUV_PACKED(GBM_FORMAT_UYVY),
+   YUV_PACKED(GBM_FORMAT_VYUY),
+
+   YUV_PLANAR(GBM_FORMAT_NV12, 2, 1, 2, 0, 2, 2),
+   YUV_PLANAR(GBM_FORMAT_NV21, 2, 1, 2, 0, 2, 2),
+   YUV_PLANAR(GBM_FORMAT_NV16, 2, 1, 2, 0, 2, 1),
+   YUV_PLANAR(GBM_FORMAT_NV61, 2, 1, 2, 0, 2, 1),
+
+   YUV_PLANAR(GBM_FORMAT_YUV420, 3, 1, 1, 1, 2, 2),
+   YUV_PLANAR(GBM_FORMAT_YVU420, 3, 1, 1, 1, 2, 2),
+};
+
+/* The layout of a format, or NULL if it isn't known. Backends size their
+ * allocations with it. */
+GBM_EXPORT const struct gbm_format_desc *
+_gbm_format_get_desc(uint32_t format)
+{
+   const struct gbm_format_desc *desc;
+
+   format = gbm_format_canonicalize(format);
+   desc = &formats[GBM_FORMAT_SLOT(format)];
+
+   /* empty slots have no planes */
+   if (desc->format != format || !desc->num_planes)
+      return NULL;
+
+   return desc;
+}
+
+/* Bits-per-pixel of a single plane format, 0 if unknown. Also used by
+ * backends to size their allocations. */
+GBM_EXPORT uint32_t
+_gbm_format_get_bpp(uint32_t format)
+{
+   const struct gbm_format_desc *desc = _gbm_format_get_desc(format);
+
+   return desc ? desc->bpp : 0;
+}
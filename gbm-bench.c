@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Microbenchmarks of the allocation, import and map paths.
+ *
+ * Runs against a DRM node with dumb buffer support, e.g. a KMS driver or
+ * vgem, and prints one JSON object per line:
+ *
+ *   {"test":"create","format":"XR24","width":1920,"height":1080,
+ *    "iterations":1000,"ns_per_op":1234,"ops_per_sec":810372,
+ *    "mib_per_sec":0}
+ *
+ * followed by the device statistics, so that runs of different releases
+ * can be compared with any JSON tool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gbm.h"
+#include "gbm_kmsint.h"
+
+struct bench_size {
+	uint32_t width;
+	uint32_t height;
+};
+
+static const struct bench_size sizes[] = {
+	{ 64, 64 },
+	{ 256, 256 },
+	{ 1280, 720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+};
+
+static const uint32_t formats[] = {
+	GBM_FORMAT_XRGB8888,
+	GBM_FORMAT_RGB565,
+	GBM_FORMAT_NV12,
+};
+
+#define ARRAY_SIZE(a)	(sizeof(a) / sizeof((a)[0]))
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void report(const char *test, uint32_t format, uint32_t width,
+		   uint32_t height, unsigned int iterations, uint64_t elapsed,
+		   uint64_t bytes)
+{
+	struct gbm_format_name_desc name;
+	double secs;
+
+	if (!elapsed)
+		elapsed = 1;
+	secs = elapsed / 1e9;
+
+	printf("{\"test\":\"%s\",\"format\":\"%s\",\"width\":%u,"
+	       "\"height\":%u,\"iterations\":%u,\"ns_per_op\":%llu,"
+	       "\"ops_per_sec\":%.0f,\"mib_per_sec\":%.1f}\n",
+	       test, gbm_format_get_name(format, &name), width, height,
+	       iterations, (unsigned long long)(elapsed / iterations),
+	       iterations / secs, bytes / secs / (1024 * 1024));
+	fflush(stdout);
+}
+
+static void report_error(const char *test, uint32_t format, uint32_t width,
+			 uint32_t height)
+{
+	struct gbm_format_name_desc name;
+
+	printf("{\"test\":\"%s\",\"format\":\"%s\",\"width\":%u,"
+	       "\"height\":%u,\"error\":\"%s\"}\n",
+	       test, gbm_format_get_name(format, &name), width, height,
+	       strerror(errno));
+	fflush(stdout);
+}
+
+/* create/destroy cycles, which the BO cache should mostly serve */
+static void bench_create(struct gbm_device *gbm, uint32_t format,
+			 uint32_t width, uint32_t height, unsigned int n)
+{
+	struct gbm_bo *bo;
+	uint64_t start;
+	unsigned int i;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (!(bo = gbm_bo_create(gbm, width, height, format,
+					 GBM_BO_USE_SCANOUT))) {
+			report_error("create", format, width, height);
+			return;
+		}
+		gbm_bo_destroy(bo);
+	}
+	report("create", format, width, height, n, now_ns() - start, 0);
+}
+
+static void close_fds(struct gbm_import_fd_modifier_data *data)
+{
+	int p;
+
+	for (p = 0; p < (int)data->num_fds; p++) {
+		if (data->fds[p] >= 0)
+			close(data->fds[p]);
+		data->fds[p] = -1;
+	}
+}
+
+/*
+ * Import of the same buffer again and again, as compositors do. Each
+ * iteration imports a fresh export, like a client sending its buffer
+ * again, and only the import and destroy are timed.
+ */
+static void bench_import(struct gbm_device *gbm, uint32_t format,
+			 uint32_t width, uint32_t height, unsigned int n)
+{
+	struct gbm_import_fd_modifier_data data = { 0 };
+	struct gbm_bo *bo, *imported;
+	uint64_t start, elapsed = 0;
+	unsigned int i;
+	int p;
+
+	if (!(bo = gbm_bo_create(gbm, width, height, format,
+				 GBM_BO_USE_SCANOUT))) {
+		report_error("import", format, width, height);
+		return;
+	}
+
+	data.width = width;
+	data.height = height;
+	data.format = format;
+	data.modifier = gbm_bo_get_modifier(bo);
+	data.num_fds = gbm_bo_get_plane_count(bo);
+	for (p = 0; p < (int)data.num_fds; p++) {
+		data.fds[p] = -1;
+		data.strides[p] = gbm_bo_get_stride_for_plane(bo, p);
+		data.offsets[p] = gbm_bo_get_offset(bo, p);
+	}
+
+	for (i = 0; i < n; i++) {
+		for (p = 0; p < (int)data.num_fds; p++) {
+			if ((data.fds[p] = gbm_bo_get_fd_for_plane(bo, p)) < 0) {
+				report_error("import", format, width, height);
+				goto out;
+			}
+		}
+
+		start = now_ns();
+		if (!(imported = gbm_bo_import(gbm, GBM_BO_IMPORT_FD_MODIFIER,
+					       &data, 0))) {
+			report_error("import", format, width, height);
+			goto out;
+		}
+		gbm_bo_destroy(imported);
+		elapsed += now_ns() - start;
+
+		close_fds(&data);
+	}
+	report("import", format, width, height, n, elapsed, 0);
+
+ out:
+	close_fds(&data);
+	gbm_bo_destroy(bo);
+}
+
+/*
+ * Importing a BO of our own gets its very GEM handle back. Destroying the
+ * import must leave that handle to the original, which is mapped through
+ * it afterwards.
+ */
+static void check_import(struct gbm_device *gbm, uint32_t format,
+			 uint32_t width, uint32_t height)
+{
+	struct gbm_format_name_desc name;
+	struct gbm_import_fd_data data = { 0 };
+	struct gbm_bo *bo, *imported;
+	uint32_t stride;
+	void *map_data;
+
+	if (!(bo = gbm_bo_create(gbm, width, height, format,
+				 GBM_BO_USE_SCANOUT))) {
+		report_error("import_check", format, width, height);
+		return;
+	}
+
+	data.width = width;
+	data.height = height;
+	data.format = format;
+	data.stride = gbm_bo_get_stride(bo);
+	if ((data.fd = gbm_bo_get_fd(bo)) < 0) {
+		report_error("import_check", format, width, height);
+		goto out;
+	}
+
+	if (!(imported = gbm_bo_import(gbm, GBM_BO_IMPORT_FD, &data, 0))) {
+		report_error("import_check", format, width, height);
+		goto out;
+	}
+	gbm_bo_destroy(imported);
+
+	if (!gbm_bo_map(bo, 0, 0, width, height, GBM_BO_TRANSFER_READ_WRITE,
+			&stride, &map_data)) {
+		report_error("import_check", format, width, height);
+		goto out;
+	}
+	gbm_bo_unmap(bo, map_data);
+
+	printf("{\"test\":\"import_check\",\"format\":\"%s\",\"width\":%u,"
+	       "\"height\":%u,\"result\":\"ok\"}\n",
+	       gbm_format_get_name(format, &name), width, height);
+	fflush(stdout);
+
+ out:
+	if (data.fd >= 0)
+		close(data.fd);
+	gbm_bo_destroy(bo);
+}
+
+static void bench_map(struct gbm_device *gbm, uint32_t format,
+		      uint32_t width, uint32_t height, unsigned int n)
+{
+	struct gbm_bo *bo;
+	uint32_t stride;
+	void *map_data;
+	uint64_t start;
+	unsigned int i;
+
+	if (!(bo = gbm_bo_create(gbm, width, height, format,
+				 GBM_BO_USE_SCANOUT))) {
+		report_error("map", format, width, height);
+		return;
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (!gbm_bo_map(bo, 0, 0, width, height,
+				GBM_BO_TRANSFER_READ_WRITE, &stride,
+				&map_data)) {
+			report_error("map", format, width, height);
+			goto out;
+		}
+		gbm_bo_unmap(bo, map_data);
+	}
+	report("map", format, width, height, n, now_ns() - start, 0);
+
+ out:
+	gbm_bo_destroy(bo);
+}
+
+static void bench_write(struct gbm_device *gbm, uint32_t format,
+			uint32_t width, uint32_t height, unsigned int n)
+{
+	struct gbm_bo *bo;
+	uint64_t start;
+	unsigned int i;
+	size_t size;
+	void *buf;
+
+	if (!(bo = gbm_bo_create(gbm, width, height, format,
+				 GBM_BO_USE_WRITE))) {
+		report_error("write", format, width, height);
+		return;
+	}
+
+	// the first plane only, which is what every format has
+	size = (size_t)gbm_bo_get_stride(bo) * height;
+	if (!(buf = malloc(size))) {
+		report_error("write", format, width, height);
+		goto out;
+	}
+	memset(buf, 0x5a, size);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		if (gbm_bo_write(bo, buf, size)) {
+			report_error("write", format, width, height);
+			goto out_free;
+		}
+	}
+	report("write", format, width, height, n, now_ns() - start,
+	       (uint64_t)size * n);
+
+ out_free:
+	free(buf);
+ out:
+	gbm_bo_destroy(bo);
+}
+
+/*
+ * What a compositor does every frame: the GL stack picks the back buffer,
+ * then the front buffer gets locked for scanout and released afterwards.
+ */
+static void bench_surface(struct gbm_device *gbm, uint32_t format,
+			  uint32_t width, uint32_t height, unsigned int n)
+{
+	struct gbm_surface *surface;
+	struct gbm_kms_surface *ks;
+	struct gbm_bo *bo;
+	uint64_t start;
+	unsigned int i;
+
+	if (!(surface = gbm_surface_create(gbm, width, height, format,
+					   GBM_BO_USE_SCANOUT |
+					   GBM_BO_USE_RENDERING))) {
+		report_error("lock_front", format, width, height);
+		return;
+	}
+	ks = gbm_kms_surface(surface);
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		gbm_kms_set_front(ks, i % gbm_kms_get_num_bufs(ks));
+		if (!(bo = gbm_surface_lock_front_buffer(surface))) {
+			report_error("lock_front", format, width, height);
+			goto out;
+		}
+		gbm_surface_release_buffer(surface, bo);
+	}
+	report("lock_front", format, width, height, n, now_ns() - start, 0);
+
+ out:
+	gbm_surface_destroy(surface);
+}
+
+static void report_stats(struct gbm_device *gbm)
+{
+	struct gbm_device_stats stats;
+
+	if (gbm_device_get_stats(gbm, &stats))
+		return;
+
+	printf("{\"stats\":{\"live_bos\":%llu,\"live_bytes\":%llu,"
+	       "\"bo_created\":%llu,\"bo_imported\":%llu,"
+	       "\"bo_destroyed\":%llu,\"prime_exports\":%llu,"
+	       "\"prime_imports\":%llu,\"maps\":%llu,\"unmaps\":%llu,"
+	       "\"mmaps\":%llu,\"mmaps_avoided\":%llu,"
+	       "\"cache_hits\":%llu,\"cache_misses\":%llu,"
+	       "\"cached_bytes\":%llu,\"cache_evictions\":%llu}}\n",
+	       (unsigned long long)stats.live_bos,
+	       (unsigned long long)stats.live_bytes,
+	       (unsigned long long)stats.bo_created,
+	       (unsigned long long)stats.bo_imported,
+	       (unsigned long long)stats.bo_destroyed,
+	       (unsigned long long)stats.prime_exports,
+	       (unsigned long long)stats.prime_imports,
+	       (unsigned long long)stats.maps,
+	       (unsigned long long)stats.unmaps,
+	       (unsigned long long)stats.mmaps,
+	       (unsigned long long)stats.mmaps_avoided,
+	       (unsigned long long)stats.cache_hits,
+	       (unsigned long long)stats.cache_misses,
+	       (unsigned long long)stats.cached_bytes,
+	       (unsigned long long)stats.cache_evictions);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-n iterations]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "/dev/dri/card0";
+	unsigned int iterations = 1000;
+	struct gbm_device *gbm;
+	unsigned int f, s;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "d:n:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!iterations) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// let surfaces come with their own buffers
+	setenv("GBM_KMS_SURFACE_ALLOC", "1", 0);
+
+	if ((fd = open(device, O_RDWR | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "%s: %s\n", device, strerror(errno));
+		return 1;
+	}
+
+	if (!(gbm = gbm_create_device(fd))) {
+		fprintf(stderr, "%s: no gbm device: %s\n", device,
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	for (f = 0; f < ARRAY_SIZE(formats); f++) {
+		for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+			uint32_t w = sizes[s].width, h = sizes[s].height;
+
+			bench_create(gbm, formats[f], w, h, iterations);
+			check_import(gbm, formats[f], w, h);
+			bench_import(gbm, formats[f], w, h, iterations);
+			bench_map(gbm, formats[f], w, h, iterations);
+			bench_write(gbm, formats[f], w, h, iterations);
+			bench_surface(gbm, formats[f], w, h, iterations);
+		}
+	}
+
+	report_stats(gbm);
+
+	gbm_device_destroy(gbm);
+	close(fd);
+
+	return 0;
+}
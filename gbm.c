@@ -25,6 +25,10 @@
  *    Benjamin Franzke <benjaminfranzke@googlemail.com>
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,10 +44,23 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/kcmp.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
 
 #include "gbm.h"
 #include "gbmint.h"
 #include "backend.h"
+#include "common.h"
+
+/* Open devices, so that the same device is handed out again */
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gbm_device *devices;
 
 /** Returns the file description for the gbm device
  *
@@ -55,6 +72,39 @@ gbm_device_get_fd(struct gbm_device *gbm)
    return gbm->fd;
 }
 
+/** Get the device node the gbm device was created with
+ *
+ * \return The path of the node, e.g. /dev/dri/card0, or %NULL if it is
+ * not known. It belongs to the device and must not be freed.
+ */
+GBM_EXPORT const char *
+gbm_device_get_node_name(struct gbm_device *gbm)
+{
+   return gbm->identity.node[0] ? gbm->identity.node : NULL;
+}
+
+/** Get the render node of the DRM device behind the gbm device
+ *
+ * \return The path of the render node, e.g. /dev/dri/renderD128, or %NULL
+ * if the device has none. It belongs to the device and must not be freed.
+ */
+GBM_EXPORT const char *
+gbm_device_get_render_node_name(struct gbm_device *gbm)
+{
+   return gbm->identity.render_node[0] ? gbm->identity.render_node : NULL;
+}
+
+/** Get the name of the kernel driver behind the gbm device
+ *
+ * \return The driver name, or %NULL if it is not known. It belongs to the
+ * device and must not be freed.
+ */
+GBM_EXPORT const char *
+gbm_device_get_driver_name(struct gbm_device *gbm)
+{
+   return gbm->identity.driver[0] ? gbm->identity.driver : NULL;
+}
+
 /** Get the backend name for the given gbm device
  *
  * \return The backend name string - this belongs to the device and must not
@@ -100,33 +150,349 @@ gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm,
 }
 
 /** Destroy the gbm device and free all resources associated with it.
+ *
+ * All buffer objects and surfaces of the device must have been destroyed
+ * before the last reference to it is dropped; buffer objects left over
+ * are leaked and must not be used or destroyed afterwards.
  *
  * \param gbm The device created using gbm_create_device()
  */
 GBM_EXPORT void
 gbm_device_destroy(struct gbm_device *gbm)
 {
-   gbm->refcount--;
-   if (gbm->refcount == 0)
-      gbm->destroy(gbm);
+   struct gbm_trace_callback *callback;
+   struct gbm_device **p;
+
+   pthread_mutex_lock(&devices_lock);
+
+   if (--gbm->refcount) {
+      pthread_mutex_unlock(&devices_lock);
+      return;
+   }
+
+   for (p = &devices; *p; p = &(*p)->next) {
+      if (*p == gbm) {
+         *p = gbm->next;
+         break;
+      }
+   }
+
+   pthread_mutex_unlock(&devices_lock);
+
+   callback = gbm->trace.callback;
+   gbm->destroy(gbm);
+
+   while (callback) {
+      struct gbm_trace_callback *prev = callback->prev;
+
+      free(callback);
+      callback = prev;
+   }
 }
 
-/** Create a gbm device for allocating buffers
+/** Release all buffers kept around by the backend for reuse
  *
- * The file descriptor passed in is used by the backend to communicate with
- * platform for allocating the memory. For allocations using DRI this would be
- * the file descriptor returned when opening a device such as \c
- * /dev/dri/card0
+ * Backends may keep destroyed buffer objects in a cache to serve later
+ * allocations of the same kind. This hands all of them back to the
+ * kernel. Buffer objects that are still in use are not affected.
  *
- * \param fd The file descriptor for a backend specific device
- * \return The newly created struct gbm_device. The resources associated with
- * the device should be freed with gbm_device_destroy() when it is no longer
- * needed. If the creation of the device failed NULL will be returned.
+ * \param gbm The device created using gbm_create_device()
  */
-GBM_EXPORT struct gbm_device *
-gbm_create_device(int fd)
+GBM_EXPORT void
+gbm_device_flush_cache(struct gbm_device *gbm)
+{
+   if (gbm->flush_cache)
+      gbm->flush_cache(gbm);
+}
+
+/** Limit the memory held by buffers kept around for reuse
+ *
+ * Cached buffers still take up memory the kernel may need elsewhere,
+ * e.g. in a CMA area shared with other devices.  Once the cache holds
+ * more than bytes, the least recently used buffers are released until it
+ * fits again, starting right away.
+ *
+ * Only that cache is bounded.  Memory a backend keeps for other reasons,
+ * such as the unused part of a buffer it suballocates from or a pool of
+ * cursor buffers, is not counted against the budget.
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param bytes The budget, or 0 to only apply the backend's own limits
+ * \return 0 on success, otherwise -1 is returned and errno set
+ *
+ * \sa gbm_device_trim_cache()
+ */
+GBM_EXPORT int
+gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t bytes)
+{
+   if (!gbm->set_memory_budget) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return gbm->set_memory_budget(gbm, bytes);
+}
+
+/** Release cached buffers under memory pressure
+ *
+ * Releases the least recently used buffers kept around for reuse until
+ * they hold at most keep bytes.  Call this when the system signals memory
+ * pressure; with keep 0 it is the same as gbm_device_flush_cache().  As
+ * with gbm_device_set_memory_budget(), only destroyed buffers held for
+ * reuse are released.
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param keep How many bytes the cache may go on holding
+ * \return The number of bytes released
+ */
+GBM_EXPORT uint64_t
+gbm_device_trim_cache(struct gbm_device *gbm, uint64_t keep)
+{
+   if (gbm->trim_cache)
+      return gbm->trim_cache(gbm, keep);
+
+   if (keep == 0)
+      gbm_device_flush_cache(gbm);
+
+   return 0;
+}
+
+/** Get the allocation and I/O counters of a device
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param stats Filled with the counters
+ * \return 0 on success, otherwise -1 is returned and errno set
+ */
+GBM_EXPORT int
+gbm_device_get_stats(struct gbm_device *gbm, struct gbm_device_stats *stats)
+{
+   if (!stats) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!gbm->get_stats) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return gbm->get_stats(gbm, stats);
+}
+
+/** Get the live buffers of a device broken down by format
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param formats Filled with up to count entries, may be %NULL if count is 0
+ * \param count The number of entries formats can hold
+ * \return The number of formats with live buffers, which may be larger than
+ * count, or -1 with errno set on error
+ */
+GBM_EXPORT int
+gbm_device_get_format_stats(struct gbm_device *gbm,
+                            struct gbm_format_stats *formats,
+                            unsigned int count)
+{
+   if (count && !formats) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!gbm->get_format_stats) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return gbm->get_format_stats(gbm, formats, count);
+}
+
+/** List the buffers the user holds, with where they were allocated
+ *
+ * Only works while buffer tracking is enabled in the backend, e.g. with
+ * GBM_KMS_TRACK_BOS set for the kms backend.  Each buffer is listed with
+ * its size, how its memory is owned, how long it has been held and the
+ * backtrace of the call that handed it out.  Whatever is still held when
+ * the device is destroyed is listed on stderr.
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param fd Where to write the list
+ * \return The number of buffers listed, or -1 with errno set if buffers
+ * are not tracked
+ */
+GBM_EXPORT int
+gbm_device_dump_bos(struct gbm_device *gbm, int fd)
+{
+   if (!gbm->dump_bos) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return gbm->dump_bos(gbm, fd);
+}
+
+/* GBM_TRACE=1 turns tracing on, GBM_TRACE=0 or anything else leaves it off */
+static int
+gbm_trace_enabled_by_env(void)
+{
+   const char *str = getenv("GBM_TRACE");
+   char *end;
+   unsigned long val;
+
+   if (!str || !*str)
+      return 0;
+
+   errno = 0;
+   val = strtoul(str, &end, 0);
+   if (errno || *end)
+      return 0;
+
+   return val != 0;
+}
+
+static uint64_t
+gbm_trace_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the start time of a traced call, or 0 if tracing is off */
+GBM_EXPORT uint64_t
+_gbm_trace_begin(struct gbm_device *gbm)
+{
+   if (!__atomic_load_n(&gbm->trace.enabled, __ATOMIC_RELAXED))
+      return 0;
+
+   return gbm_trace_now();
+}
+
+GBM_EXPORT void
+_gbm_trace_end(struct gbm_device *gbm, enum gbm_trace_point point,
+               uint64_t start)
+{
+   struct gbm_latency_histogram *hist;
+   struct gbm_trace_callback *callback;
+   uint64_t duration, us, max;
+   int bucket = 0;
+
+   if (!start || point >= GBM_TRACE_COUNT)
+      return;
+
+   duration = gbm_trace_now() - start;
+
+   for (us = duration / 1000; us && bucket < GBM_LATENCY_BUCKETS - 1;
+        us >>= 1)
+      bucket++;
+
+   hist = &gbm->trace.hist[point];
+   __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&hist->total_ns, duration, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+   max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+   while (duration > max &&
+          !__atomic_compare_exchange_n(&hist->max_ns, &max, duration, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+
+#ifdef HAVE_SYS_SDT_H
+   DTRACE_PROBE3(libgbm, latency, gbm, point, duration);
+#endif
+
+   callback = __atomic_load_n(&gbm->trace.callback, __ATOMIC_ACQUIRE);
+   if (callback && callback->func)
+      callback->func(gbm, point, duration, callback->data);
+}
+
+/** Register a function to be called after every traced call
+ *
+ * Registering a function also turns on the latency histograms, which are
+ * otherwise only kept when the GBM_TRACE environment variable is set to a
+ * non-zero number.
+ * When built with systemtap's sys/sdt.h, every traced call also fires
+ * the libgbm:latency USDT probe.
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param func The function to call, or %NULL to stop calling it
+ * \param data Passed to func
+ * \return 0 on success, otherwise -1 is returned and errno set
+ *
+ * \sa enum gbm_trace_point for the list of traced calls
+ */
+GBM_EXPORT int
+gbm_device_set_trace_callback(struct gbm_device *gbm,
+                              gbm_trace_func func, void *data)
+{
+   struct gbm_trace_callback *callback;
+
+   callback = malloc(sizeof(*callback));
+   if (!callback) {
+      errno = ENOMEM;
+      return -1;
+   }
+   callback->func = func;
+   callback->data = data;
+
+   /* func and data are published together; running calls may go on
+    * with the old pair, which is why it is not freed here */
+   callback->prev = __atomic_exchange_n(&gbm->trace.callback, callback,
+                                        __ATOMIC_ACQ_REL);
+
+   if (func)
+      __atomic_store_n(&gbm->trace.enabled, 1, __ATOMIC_RELAXED);
+
+   return 0;
+}
+
+/** Get the latency histogram of a traced call
+ *
+ * \param gbm The device created using gbm_create_device()
+ * \param point The traced call
+ * \param hist Filled with the histogram
+ * \return 0 on success, otherwise -1 is returned and errno set
+ */
+GBM_EXPORT int
+gbm_device_get_latency(struct gbm_device *gbm, enum gbm_trace_point point,
+                       struct gbm_latency_histogram *hist)
+{
+   struct gbm_latency_histogram *src;
+   int i;
+
+   if (point >= GBM_TRACE_COUNT || !hist) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   src = &gbm->trace.hist[point];
+   hist->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+   hist->total_ns = __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+   hist->max_ns = __atomic_load_n(&src->max_ns, __ATOMIC_RELAXED);
+   for (i = 0; i < GBM_LATENCY_BUCKETS; i++)
+      hist->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+
+   return 0;
+}
+
+/* Whether the two fds are the same open file, i.e. share GEM handles */
+static int
+same_file(int fd1, int fd2)
+{
+   if (fd1 == fd2)
+      return 1;
+
+#ifdef SYS_kcmp
+   return syscall(SYS_kcmp, getpid(), getpid(), KCMP_FILE, fd1, fd2) == 0;
+#else
+   return 0;
+#endif
+}
+
+static struct gbm_device *
+create_device(int fd, int shared)
 {
    struct gbm_device *gbm = NULL;
+   struct gbm_device_identity identity;
    struct stat buf;
 
    if (fd < 0 || fstat(fd, &buf) < 0 || !S_ISCHR(buf.st_mode)) {
@@ -134,17 +500,79 @@ gbm_create_device(int fd)
       return NULL;
    }
 
-   gbm = _gbm_create_device(fd);
+   pthread_mutex_lock(&devices_lock);
+
+   for (gbm = devices; gbm; gbm = gbm->next) {
+      if (gbm->stat.st_rdev == buf.st_rdev &&
+          (shared || same_file(gbm->fd, fd))) {
+         gbm->refcount++;
+         goto out;
+      }
+   }
+
+   _gbm_device_identity_init(&identity, fd, &buf);
+
+   gbm = _gbm_create_device(fd, identity.driver);
    if (gbm == NULL)
-      return NULL;
+      goto out;
 
    gbm->dummy = gbm_create_device;
    gbm->stat = buf;
+   gbm->identity = identity;
    gbm->refcount = 1;
+   gbm->trace.enabled = gbm_trace_enabled_by_env();
+   gbm->trace.callback = NULL;
+
+   gbm->next = devices;
+   devices = gbm;
 
+out:
+   pthread_mutex_unlock(&devices_lock);
    return gbm;
 }
 
+/** Create a gbm device for allocating buffers
+ *
+ * The file descriptor passed in is used by the backend to communicate with
+ * platform for allocating the memory. For allocations using DRI this would be
+ * the file descriptor returned when opening a device such as \c
+ * /dev/dri/card0. Render nodes such as \c /dev/dri/renderD128 work as well,
+ * for processes that only allocate and don't drive the display.
+ *
+ * Creating a device again for the same open file returns the existing
+ * device with its reference count raised.
+ *
+ * \param fd The file descriptor for a backend specific device
+ * \return The newly created struct gbm_device. The resources associated with
+ * the device should be freed with gbm_device_destroy() when it is no longer
+ * needed. If the creation of the device failed NULL will be returned.
+ *
+ * \sa gbm_create_device_shared()
+ */
+GBM_EXPORT struct gbm_device *
+gbm_create_device(int fd)
+{
+   return create_device(fd, 0);
+}
+
+/** Get a gbm device for a device node, shared with other callers
+ *
+ * Like gbm_create_device(), but returns any device already created for the
+ * same device node, even from another file descriptor, so that the backend
+ * state is shared by all users of the node in the process.
+ *
+ * Buffer handles then belong to the file descriptor returned by
+ * gbm_device_get_fd(), which may not be fd.
+ *
+ * \param fd The file descriptor for a backend specific device
+ * \return The device, to be released with gbm_device_destroy(), or %NULL
+ */
+GBM_EXPORT struct gbm_device *
+gbm_create_device_shared(int fd)
+{
+   return create_device(fd, 1);
+}
+
 /** Get the width of the buffer object
  *
  * \param bo The buffer object
@@ -212,69 +640,20 @@ gbm_bo_get_format(struct gbm_bo *bo)
  *
  * The bits-per-pixel of the buffer object's format.
  *
- * Note; The 'in-memory pixel' concept makes no sense for YUV formats
- * (pixels are the result of the combination of multiple memory sources:
- * Y, Cb & Cr; usually these are even in separate buffers), so YUV
- * formats are not supported by this function.
+ * Note; The 'in-memory pixel' concept makes no sense for planar YUV
+ * formats (pixels are the result of the combination of multiple memory
+ * sources: Y, Cb & Cr, each in its own plane), so 0 is returned for
+ * them. Packed 4:2:2 formats (YUYV, YVYU, UYVY and VYUY) store two
+ * pixels in 32 bits and are reported as 16 bits-per-pixel.
  *
  * \param bo The buffer object
- * \return The number of bits0per-pixel of the buffer object's format.
+ * \return The number of bits-per-pixel of the buffer object's format, or 0
+ * if it is planar or unknown.
  */
 GBM_EXPORT uint32_t
 gbm_bo_get_bpp(struct gbm_bo *bo)
 {
-   switch (bo->format) {
-      default:
-         return 0;
-      case GBM_FORMAT_C8:
-      case GBM_FORMAT_R8:
-      case GBM_FORMAT_RGB332:
-      case GBM_FORMAT_BGR233:
-         return 8;
-      case GBM_FORMAT_GR88:
-      case GBM_FORMAT_XRGB4444:
-      case GBM_FORMAT_XBGR4444:
-      case GBM_FORMAT_RGBX4444:
-      case GBM_FORMAT_BGRX4444:
-      case GBM_FORMAT_ARGB4444:
-      case GBM_FORMAT_ABGR4444:
-      case GBM_FORMAT_RGBA4444:
-      case GBM_FORMAT_BGRA4444:
-      case GBM_FORMAT_XRGB1555:
-      case GBM_FORMAT_XBGR1555:
-      case GBM_FORMAT_RGBX5551:
-      case GBM_FORMAT_BGRX5551:
-      case GBM_FORMAT_ARGB1555:
-      case GBM_FORMAT_ABGR1555:
-      case GBM_FORMAT_RGBA5551:
-      case GBM_FORMAT_BGRA5551:
-      case GBM_FORMAT_RGB565:
-      case GBM_FORMAT_BGR565:
-         return 16;
-      case GBM_FORMAT_RGB888:
-      case GBM_FORMAT_BGR888:
-         return 24;
-      case GBM_FORMAT_XRGB8888:
-      case GBM_FORMAT_XBGR8888:
-      case GBM_FORMAT_RGBX8888:
-      case GBM_FORMAT_BGRX8888:
-      case GBM_FORMAT_ARGB8888:
-      case GBM_FORMAT_ABGR8888:
-      case GBM_FORMAT_RGBA8888:
-      case GBM_FORMAT_BGRA8888:
-      case GBM_FORMAT_XRGB2101010:
-      case GBM_FORMAT_XBGR2101010:
-      case GBM_FORMAT_RGBX1010102:
-      case GBM_FORMAT_BGRX1010102:
-      case GBM_FORMAT_ARGB2101010:
-      case GBM_FORMAT_ABGR2101010:
-      case GBM_FORMAT_RGBA1010102:
-      case GBM_FORMAT_BGRA1010102:
-         return 32;
-      case GBM_FORMAT_XBGR16161616F:
-      case GBM_FORMAT_ABGR16161616F:
-         return 64;
-   }
+   return _gbm_format_get_bpp(bo->format);
 }
 
 /** Get the offset for the data of the specified plane
@@ -383,6 +762,32 @@ gbm_bo_get_fd_for_plane(struct gbm_bo *bo, int plane)
    return bo->gbm->bo_get_plane_fd(bo, plane);
 }
 
+/** Get the DMA-BUF file descriptor the buffer object holds for a plane
+ *
+ * Unlike gbm_bo_get_fd_for_plane(), this does not create a new file
+ * descriptor. The backend exports the plane once and keeps the file
+ * descriptor for the lifetime of the buffer object, so repeated calls
+ * are cheap. The caller must not close it, and must dup() it if it
+ * needs the file descriptor to outlive the buffer object.
+ *
+ * \param bo The buffer object
+ * \param plane The plane to get a DMA-BUF for
+ * \return Returns a file descriptor owned by the buffer object or -1 if
+ * an error occurs.
+ *
+ * \sa gbm_bo_get_fd_for_plane()
+ */
+GBM_EXPORT int
+gbm_bo_borrow_fd_for_plane(struct gbm_bo *bo, int plane)
+{
+   if (!bo->gbm->bo_borrow_plane_fd) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return bo->gbm->bo_borrow_plane_fd(bo, plane);
+}
+
 /**
  * Get the chosen modifier for the buffer object
  *
@@ -418,7 +823,230 @@ gbm_bo_get_modifier(struct gbm_bo *bo)
 GBM_EXPORT int
 gbm_bo_write(struct gbm_bo *bo, const void *buf, size_t count)
 {
-   return bo->gbm->bo_write(bo, buf, count);
+   uint64_t start = _gbm_trace_begin(bo->gbm);
+   int ret;
+
+   ret = bo->gbm->bo_write(bo, buf, count);
+   _gbm_trace_end(bo->gbm, GBM_TRACE_BO_WRITE, start);
+
+   return ret;
+}
+
+/** Attach a fence to be waited for before using the buffer object
+ *
+ * The producer of the buffer contents, e.g. the GL stack, attaches the
+ * sync_file that signals when it is finished. Consumers get it with
+ * gbm_bo_get_fence() and CPU access through gbm_bo_map() waits for it.
+ * A fence attached while another one is pending is merged with it.
+ *
+ * \param bo The buffer object
+ * \param fence_fd The sync_file, which the buffer object takes over
+ * \return 0 on success, otherwise -1 is returned and errno set
+ */
+GBM_EXPORT int
+gbm_bo_set_fence(struct gbm_bo *bo, int fence_fd)
+{
+   if (fence_fd < 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!bo->gbm->bo_set_fence) {
+      close(fence_fd);
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return bo->gbm->bo_set_fence(bo, fence_fd, 0);
+}
+
+/** Get the fence that signals when the buffer contents are ready
+ *
+ * \param bo The buffer object
+ * \return A new file descriptor of the sync_file, to be closed by the
+ * caller, or -1 if there is nothing to wait for
+ *
+ * \sa gbm_bo_set_fence()
+ */
+GBM_EXPORT int
+gbm_bo_get_fence(struct gbm_bo *bo)
+{
+   if (!bo->gbm->bo_get_fence)
+      return -1;
+
+   return bo->gbm->bo_get_fence(bo, 0);
+}
+
+/** Get the fence that signals when the consumer is done with the buffer
+ *
+ * \param bo The buffer object
+ * \return A new file descriptor of the sync_file, to be closed by the
+ * caller, or -1 if there is nothing to wait for
+ *
+ * \sa gbm_surface_release_buffer_fence()
+ */
+GBM_EXPORT int
+gbm_bo_get_release_fence(struct gbm_bo *bo)
+{
+   if (!bo->gbm->bo_get_fence)
+      return -1;
+
+   return bo->gbm->bo_get_fence(bo, 1);
+}
+
+/** Write a rectangle of pixels into the buffer object
+ *
+ * Unlike gbm_bo_write(), this takes the stride of the buffer into account
+ * and doesn't need the buffer to be created with GBM_BO_USE_WRITE. Only
+ * formats with a whole number of bytes per pixel are supported, and only
+ * their first plane is written.
+ *
+ * \param bo The buffer object
+ * \param buf The pixels to write, starting with the top left one
+ * \param src_stride The number of bytes between two rows in buf
+ * \param x The left of the rectangle in the buffer object, in pixels
+ * \param y The top of the rectangle in the buffer object, in pixels
+ * \param width The width of the rectangle, in pixels
+ * \param height The height of the rectangle, in pixels
+ * \return Returns 0 on success, otherwise -1 is returned an errno set
+ */
+GBM_EXPORT int
+gbm_bo_write_rect(struct gbm_bo *bo, const void *buf, uint32_t src_stride,
+                  uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+   uint32_t cpp = gbm_bo_get_bpp(bo) / 8;
+   uint64_t start;
+   uint32_t stride, i;
+   void *map_data;
+   uint8_t *dst;
+   int ret = 0;
+
+   if (!buf || width == 0 || height == 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   start = _gbm_trace_begin(bo->gbm);
+
+   if (bo->gbm->bo_write_rect) {
+      ret = bo->gbm->bo_write_rect(bo, buf, 0, src_stride,
+                                   x, y, width, height);
+      goto out;
+   }
+
+   if (!cpp || src_stride < width * cpp) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+   }
+
+   dst = gbm_bo_map(bo, x, y, width, height, GBM_BO_TRANSFER_WRITE,
+                    &stride, &map_data);
+   if (!dst) {
+      ret = -1;
+      goto out;
+   }
+
+   for (i = 0; i < height; i++)
+      memcpy(dst + i * stride, (const uint8_t *)buf + i * src_stride,
+             width * cpp);
+
+   gbm_bo_unmap(bo, map_data);
+
+out:
+   _gbm_trace_end(bo->gbm, GBM_TRACE_BO_WRITE, start);
+   return ret;
+}
+
+/** Write a rectangle of pixels in another format into the buffer object
+ *
+ * Like gbm_bo_write_rect(), but the pixels of buf are in src_format and
+ * are converted to the format of the buffer object while they are
+ * copied, saving a separate conversion pass.  Which conversions are
+ * available depends on the backend; the KMS backend converts from
+ * RGB888, BGR888 and 32 bit RGB formats to 32 bit RGB formats, swapping
+ * red and blue as needed.
+ *
+ * \param bo The buffer object
+ * \param buf The pixels to write
+ * \param src_format The format of buf, from GBM_FORMAT_* tokens
+ * \param src_stride The distance between two rows of buf in bytes
+ * \param x The left edge of the rectangle in the buffer object
+ * \param y The top edge of the rectangle in the buffer object
+ * \param width The width of the rectangle
+ * \param height The height of the rectangle
+ * \return Returns 0 on success, otherwise -1 is returned and errno set,
+ * to EINVAL if the conversion isn't supported
+ */
+GBM_EXPORT int
+gbm_bo_write_rect_convert(struct gbm_bo *bo, const void *buf,
+                          uint32_t src_format, uint32_t src_stride,
+                          uint32_t x, uint32_t y,
+                          uint32_t width, uint32_t height)
+{
+   uint64_t start;
+   int ret;
+
+   src_format = gbm_format_canonicalize(src_format);
+   if (src_format == bo->format)
+      return gbm_bo_write_rect(bo, buf, src_stride, x, y, width, height);
+
+   if (!buf || width == 0 || height == 0) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (!bo->gbm->bo_write_rect) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   start = _gbm_trace_begin(bo->gbm);
+   ret = bo->gbm->bo_write_rect(bo, buf, src_format, src_stride,
+                                x, y, width, height);
+   _gbm_trace_end(bo->gbm, GBM_TRACE_BO_WRITE, start);
+
+   return ret;
+}
+
+/** Write data into the buffer object without waiting for the copy
+ *
+ * Like gbm_bo_write(), but the copy is done by the backend in the
+ * background, possibly split up between several threads, so the caller
+ * can go on producing the next frame meanwhile.  Once the data has been
+ * written, done is called, from whichever thread finished the copy.
+ * Until then buf must stay valid and the buffer object must not be
+ * destroyed.  Writes to the same buffer object land in the order they
+ * were made, synchronous ones included.
+ *
+ * Backends without asynchronous writes copy the data right away and call
+ * done before returning.
+ *
+ * \param bo The buffer object
+ * \param buf The data to write
+ * \param count The number of bytes to write
+ * \param done Called when the write has finished
+ * \param data Passed to done
+ * \return Returns 0 if the write was started, otherwise -1 is returned
+ * and errno set. done is not called then.
+ */
+GBM_EXPORT int
+gbm_bo_write_async(struct gbm_bo *bo, const void *buf, size_t count,
+                   gbm_bo_write_done_func done, void *data)
+{
+   if (!buf || !done) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (bo->gbm->bo_write_async)
+      return bo->gbm->bo_write_async(bo, buf, count, done, data);
+
+   if (gbm_bo_write(bo, buf, count))
+      return -1;
+
+   done(bo, 0, data);
+   return 0;
 }
 
 /** Set the user data associated with a buffer object
@@ -459,6 +1087,11 @@ gbm_bo_get_user_data(struct gbm_bo *bo)
 GBM_EXPORT void
 gbm_bo_destroy(struct gbm_bo *bo)
 {
+   /* The backend may hand out the same bo more than once, e.g. when the
+    * same buffer is imported twice. Only the last destroy frees it. */
+   if (bo->gbm->bo_unref && bo->gbm->bo_unref(bo))
+      return;
+
    if (bo->destroy_user_data)
       bo->destroy_user_data(bo, bo->user_data);
 
@@ -486,12 +1119,19 @@ gbm_bo_create(struct gbm_device *gbm,
               uint32_t width, uint32_t height,
               uint32_t format, uint32_t usage)
 {
+   uint64_t start;
+   struct gbm_bo *bo;
+
    if (width == 0 || height == 0) {
       errno = EINVAL;
       return NULL;
    }
 
-   return gbm->bo_create(gbm, width, height, format, usage, NULL, 0);
+   start = _gbm_trace_begin(gbm);
+   bo = gbm->bo_create(gbm, width, height, format, usage, NULL, 0);
+   _gbm_trace_end(gbm, GBM_TRACE_BO_CREATE, start);
+
+   return bo;
 }
 
 GBM_EXPORT struct gbm_bo *
@@ -501,6 +1141,9 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              const uint64_t *modifiers,
                              const unsigned int count)
 {
+   uint64_t start;
+   struct gbm_bo *bo;
+
    if (width == 0 || height == 0) {
       errno = EINVAL;
       return NULL;
@@ -511,7 +1154,79 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
       return NULL;
    }
 
-   return gbm->bo_create(gbm, width, height, format, 0, modifiers, count);
+   start = _gbm_trace_begin(gbm);
+   bo = gbm->bo_create(gbm, width, height, format, 0, modifiers, count);
+   _gbm_trace_end(gbm, GBM_TRACE_BO_CREATE, start);
+
+   return bo;
+}
+
+/**
+ * Allocate a number of identical buffer objects at once
+ *
+ * This is a convenience for setting up swapchains and buffer pools. A
+ * backend may do the format and modifier checks once for the whole
+ * batch, but each buffer is still allocated on its own, so this is no
+ * faster than calling gbm_bo_create_with_modifiers() num times.
+ *
+ * \param gbm The gbm device returned from gbm_create_device()
+ * \param width The width for the buffers
+ * \param height The height for the buffers
+ * \param format The format to use for the buffers
+ * \param flags The union of the usage flags for the buffers
+ * \param modifiers List of modifiers, or %NULL
+ * \param count Number of entries in modifiers
+ * \param bos Array receiving the buffer objects
+ * \param num Number of buffer objects to allocate
+ *
+ * \return 0 on success and bos holds num buffers to be freed with
+ * gbm_bo_destroy(). Otherwise -1 is returned, errno is set and no buffer
+ * is allocated.
+ *
+ * \sa gbm_bo_create_with_modifiers()
+ */
+GBM_EXPORT int
+gbm_bo_create_array(struct gbm_device *gbm,
+                    uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t flags,
+                    const uint64_t *modifiers,
+                    const unsigned int count,
+                    struct gbm_bo **bos, unsigned int num)
+{
+   unsigned int i;
+   int err;
+
+   if (width == 0 || height == 0 || !bos) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if ((count && !modifiers) || (modifiers && !count)) {
+      errno = EINVAL;
+      return -1;
+   }
+
+   if (gbm->bo_create_array)
+      return gbm->bo_create_array(gbm, width, height, format, flags,
+                                  modifiers, count, bos, num);
+
+   for (i = 0; i < num; i++) {
+      bos[i] = gbm->bo_create(gbm, width, height, format, flags,
+                              modifiers, count);
+      if (!bos[i])
+         goto fail;
+   }
+
+   return 0;
+
+fail:
+   err = errno;
+   while (i--) {
+      gbm_bo_destroy(bos[i]);
+      bos[i] = NULL;
+   }
+   errno = err;
+   return -1;
 }
 
 /**
@@ -545,7 +1260,13 @@ GBM_EXPORT struct gbm_bo *
 gbm_bo_import(struct gbm_device *gbm,
               uint32_t type, void *buffer, uint32_t usage)
 {
-   return gbm->bo_import(gbm, type, buffer, usage);
+   uint64_t start = _gbm_trace_begin(gbm);
+   struct gbm_bo *bo;
+
+   bo = gbm->bo_import(gbm, type, buffer, usage);
+   _gbm_trace_end(gbm, GBM_TRACE_BO_IMPORT, start);
+
+   return bo;
 }
 
 /**
@@ -577,13 +1298,20 @@ gbm_bo_map(struct gbm_bo *bo,
               uint32_t width, uint32_t height,
               uint32_t flags, uint32_t *stride, void **map_data)
 {
+   uint64_t start;
+   void *addr;
+
    if (!bo || width == 0 || height == 0 || !stride || !map_data) {
       errno = EINVAL;
       return NULL;
    }
 
-   return bo->gbm->bo_map(bo, x, y, width, height,
+   start = _gbm_trace_begin(bo->gbm);
+   addr = bo->gbm->bo_map(bo, x, y, width, height,
                           flags, stride, map_data);
+   _gbm_trace_end(bo->gbm, GBM_TRACE_BO_MAP, start);
+
+   return addr;
 }
 
 /**
@@ -598,7 +1326,10 @@ gbm_bo_map(struct gbm_bo *bo,
 GBM_EXPORT void
 gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
 {
+   uint64_t start = _gbm_trace_begin(bo->gbm);
+
    bo->gbm->bo_unmap(bo, map_data);
+   _gbm_trace_end(bo->gbm, GBM_TRACE_BO_UNMAP, start);
 }
 
 /**
@@ -608,6 +1339,9 @@ gbm_bo_unmap(struct gbm_bo *bo, void *map_data)
  * \param width The width for the surface
  * \param height The height for the surface
  * \param format The format to use for the surface
+ * \param flags The GBM_BO_USE_* flags of the buffers, and optionally
+ * GBM_SURFACE_BUFFERS() with the number of buffers to cycle through;
+ * backends clamp it to what they support
  *
  * \return A newly allocated surface that should be freed with
  * gbm_surface_destroy() when no longer needed. If an error occurs
@@ -678,7 +1412,13 @@ gbm_surface_destroy(struct gbm_surface *surf)
 GBM_EXPORT struct gbm_bo *
 gbm_surface_lock_front_buffer(struct gbm_surface *surf)
 {
-   return surf->gbm->surface_lock_front_buffer(surf);
+   uint64_t start = _gbm_trace_begin(surf->gbm);
+   struct gbm_bo *bo;
+
+   bo = surf->gbm->surface_lock_front_buffer(surf);
+   _gbm_trace_end(surf->gbm, GBM_TRACE_SURFACE_LOCK_FRONT_BUFFER, start);
+
+   return bo;
 }
 
 /**
@@ -699,6 +1439,41 @@ gbm_surface_release_buffer(struct gbm_surface *surf, struct gbm_bo *bo)
    surf->gbm->surface_release_buffer(surf, bo);
 }
 
+/**
+ * Release a locked buffer, to be reused once a fence signals
+ *
+ * Like gbm_surface_release_buffer(), but the buffer is only done with
+ * when fence_fd, a sync_file, signals. This is typically the out-fence
+ * of the KMS commit that stops scanning the buffer out, so no one has
+ * to wait for it on the CPU.
+ *
+ * \param surf The surface
+ * \param bo The buffer object
+ * \param fence_fd The sync_file, which the surface takes over, or -1
+ * \return 0 on success, otherwise -1 is returned and errno set. The
+ * buffer is released in any case.
+ */
+GBM_EXPORT int
+gbm_surface_release_buffer_fence(struct gbm_surface *surf,
+                                 struct gbm_bo *bo, int fence_fd)
+{
+   int ret = 0;
+
+   if (fence_fd >= 0) {
+      if (surf->gbm->bo_set_fence) {
+         ret = surf->gbm->bo_set_fence(bo, fence_fd, 1);
+      } else {
+         close(fence_fd);
+         errno = ENOSYS;
+         ret = -1;
+      }
+   }
+
+   surf->gbm->surface_release_buffer(surf, bo);
+
+   return ret;
+}
+
 /**
  * Return whether or not a surface has free (non-locked) buffers
  *
@@ -721,6 +1496,59 @@ gbm_surface_has_free_buffers(struct gbm_surface *surf)
    return surf->gbm->surface_has_free_buffers(surf);
 }
 
+/**
+ * Get a file descriptor that signals released buffers
+ *
+ * The descriptor becomes readable whenever a buffer is returned to the
+ * surface with gbm_surface_release_buffer(), so an event loop can poll
+ * it instead of calling gbm_surface_has_free_buffers() repeatedly.  It is
+ * cleared by gbm_surface_try_acquire_buffer() only once no buffer is
+ * free.  The buffer that call returns is not reserved and so keeps the
+ * descriptor readable until it has become the front buffer.  A wakeup may
+ * be spurious, so callers should treat EAGAIN from
+ * gbm_surface_try_acquire_buffer() as "poll again".
+ *
+ * \param surf The surface
+ * \return The file descriptor, or -1 with errno set.  It is owned by the
+ * surface and must not be closed.
+ */
+GBM_EXPORT int
+gbm_surface_get_release_fd(struct gbm_surface *surf)
+{
+   if (!surf->gbm->surface_get_release_fd) {
+      errno = ENOSYS;
+      return -1;
+   }
+
+   return surf->gbm->surface_get_release_fd(surf);
+}
+
+/**
+ * Get the next free back buffer without blocking
+ *
+ * Returns a buffer of the surface that is neither the front buffer nor
+ * locked with gbm_surface_lock_front_buffer().  The buffer is not
+ * reserved and still belongs to the surface; calling this again before it
+ * has been rendered to and made the front buffer returns the same buffer,
+ * and the release descriptor stays readable meanwhile.
+ *
+ * \param surf The surface
+ * \return The buffer object, or %NULL with errno set to EAGAIN if all
+ * buffers are in use
+ *
+ * \sa gbm_surface_get_release_fd()
+ */
+GBM_EXPORT struct gbm_bo *
+gbm_surface_try_acquire_buffer(struct gbm_surface *surf)
+{
+   if (!surf->gbm->surface_try_acquire_buffer) {
+      errno = ENOSYS;
+      return NULL;
+   }
+
+   return surf->gbm->surface_try_acquire_buffer(surf);
+}
+
 /**
  * Returns a string representing the fourcc format name.
  *
@@ -246,12 +246,30 @@ enum gbm_bo_flags {
    GBM_BO_USE_PROTECTED = (1 << 5),
 };
 
+/**
+ * Number of buffers a gbm_surface cycles through, ored into the flags of
+ * gbm_surface_create().  Without it, the backend picks the number.
+ */
+#define GBM_SURFACE_BUFFERS_SHIFT 28
+#define GBM_SURFACE_BUFFERS_MASK  (0xfu << GBM_SURFACE_BUFFERS_SHIFT)
+#define GBM_SURFACE_BUFFERS(n) \
+   (((uint32_t)(n) << GBM_SURFACE_BUFFERS_SHIFT) & GBM_SURFACE_BUFFERS_MASK)
+
 int
 gbm_device_get_fd(struct gbm_device *gbm);
 
 const char *
 gbm_device_get_backend_name(struct gbm_device *gbm);
 
+const char *
+gbm_device_get_node_name(struct gbm_device *gbm);
+
+const char *
+gbm_device_get_render_node_name(struct gbm_device *gbm);
+
+const char *
+gbm_device_get_driver_name(struct gbm_device *gbm);
+
 int
 gbm_device_is_format_supported(struct gbm_device *gbm,
                                uint32_t format, uint32_t usage);
@@ -264,9 +282,105 @@ gbm_device_get_format_modifier_plane_count(struct gbm_device *gbm,
 void
 gbm_device_destroy(struct gbm_device *gbm);
 
+void
+gbm_device_flush_cache(struct gbm_device *gbm);
+
+int
+gbm_device_set_memory_budget(struct gbm_device *gbm, uint64_t bytes);
+
+uint64_t
+gbm_device_trim_cache(struct gbm_device *gbm, uint64_t keep);
+
+/**
+ * Counters of what a device has been doing since it was created
+ */
+struct gbm_device_stats {
+   uint64_t live_bos;       /* buffers holding memory, cached ones included */
+   uint64_t live_bytes;
+   uint64_t bo_created;
+   uint64_t bo_imported;    /* imports that returned a new buffer */
+   uint64_t bo_destroyed;
+   uint64_t prime_exports;  /* handle to dma-buf FD conversions */
+   uint64_t prime_imports;  /* dma-buf FD to handle conversions */
+   uint64_t maps;
+   uint64_t unmaps;
+   uint64_t mmaps;          /* maps that had to set up a CPU mapping */
+   uint64_t mmaps_avoided;  /* maps served by an existing mapping */
+   uint64_t cache_hits;
+   uint64_t cache_misses;
+   uint64_t cached_bytes;   /* held by destroyed buffers kept for reuse */
+   uint64_t cache_evictions;
+};
+
+/**
+ * Live buffers of one format
+ */
+struct gbm_format_stats {
+   uint32_t format;
+   uint64_t live_bos;
+   uint64_t live_bytes;
+};
+
+int
+gbm_device_get_stats(struct gbm_device *gbm, struct gbm_device_stats *stats);
+
+int
+gbm_device_get_format_stats(struct gbm_device *gbm,
+                            struct gbm_format_stats *formats,
+                            unsigned int count);
+
+int
+gbm_device_dump_bos(struct gbm_device *gbm, int fd);
+
+/**
+ * Calls that are timed when tracing is enabled
+ */
+enum gbm_trace_point {
+   GBM_TRACE_BO_CREATE,
+   GBM_TRACE_BO_IMPORT,
+   GBM_TRACE_BO_MAP,
+   GBM_TRACE_BO_UNMAP,
+   GBM_TRACE_BO_WRITE,
+   GBM_TRACE_SURFACE_LOCK_FRONT_BUFFER,
+   /* Kernel calls made by the backend on behalf of the calls above */
+   GBM_TRACE_CREATE_DUMB,
+   GBM_TRACE_PRIME_IMPORT,
+   GBM_TRACE_PRIME_EXPORT,
+   GBM_TRACE_COUNT
+};
+
+#define GBM_LATENCY_BUCKETS 16
+
+/**
+ * Latencies of one trace point. buckets[n] counts the calls that took
+ * less than 2^n microseconds but not less than 2^(n-1); the last bucket
+ * takes everything slower.
+ */
+struct gbm_latency_histogram {
+   uint64_t count;
+   uint64_t total_ns;
+   uint64_t max_ns;
+   uint64_t buckets[GBM_LATENCY_BUCKETS];
+};
+
+typedef void (*gbm_trace_func)(struct gbm_device *gbm,
+                               enum gbm_trace_point point,
+                               uint64_t duration_ns, void *data);
+
+int
+gbm_device_set_trace_callback(struct gbm_device *gbm,
+                              gbm_trace_func func, void *data);
+
+int
+gbm_device_get_latency(struct gbm_device *gbm, enum gbm_trace_point point,
+                       struct gbm_latency_histogram *hist);
+
 struct gbm_device *
 gbm_create_device(int fd);
 
+struct gbm_device *
+gbm_create_device_shared(int fd);
+
 struct gbm_bo *
 gbm_bo_create(struct gbm_device *gbm,
               uint32_t width, uint32_t height,
@@ -278,6 +392,15 @@ gbm_bo_create_with_modifiers(struct gbm_device *gbm,
                              uint32_t format,
                              const uint64_t *modifiers,
                              const unsigned int count);
+
+int
+gbm_bo_create_array(struct gbm_device *gbm,
+                    uint32_t width, uint32_t height,
+                    uint32_t format, uint32_t flags,
+                    const uint64_t *modifiers,
+                    const unsigned int count,
+                    struct gbm_bo **bos, unsigned int num);
+
 #define GBM_BO_IMPORT_WL_BUFFER         0x5501
 #define GBM_BO_IMPORT_EGL_IMAGE         0x5502
 #define GBM_BO_IMPORT_FD                0x5503
@@ -385,9 +508,42 @@ gbm_bo_get_handle_for_plane(struct gbm_bo *bo, int plane);
 int
 gbm_bo_get_fd_for_plane(struct gbm_bo *bo, int plane);
 
+int
+gbm_bo_borrow_fd_for_plane(struct gbm_bo *bo, int plane);
+
 int
 gbm_bo_write(struct gbm_bo *bo, const void *buf, size_t count);
 
+int
+gbm_bo_set_fence(struct gbm_bo *bo, int fence_fd);
+
+int
+gbm_bo_get_fence(struct gbm_bo *bo);
+
+int
+gbm_bo_get_release_fence(struct gbm_bo *bo);
+
+int
+gbm_bo_write_rect(struct gbm_bo *bo, const void *buf, uint32_t src_stride,
+                  uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+
+int
+gbm_bo_write_rect_convert(struct gbm_bo *bo, const void *buf,
+                          uint32_t src_format, uint32_t src_stride,
+                          uint32_t x, uint32_t y,
+                          uint32_t width, uint32_t height);
+
+/**
+ * Called once an asynchronous write has finished, with 0 or a negative
+ * errno value
+ */
+typedef void (*gbm_bo_write_done_func)(struct gbm_bo *bo, int status,
+                                       void *data);
+
+int
+gbm_bo_write_async(struct gbm_bo *bo, const void *buf, size_t count,
+                   gbm_bo_write_done_func done, void *data);
+
 void
 gbm_bo_set_user_data(struct gbm_bo *bo, void *data,
 		     void (*destroy_user_data)(struct gbm_bo *, void *));
@@ -416,9 +572,19 @@ gbm_surface_lock_front_buffer(struct gbm_surface *surface);
 void
 gbm_surface_release_buffer(struct gbm_surface *surface, struct gbm_bo *bo);
 
+int
+gbm_surface_release_buffer_fence(struct gbm_surface *surface,
+                                 struct gbm_bo *bo, int fence_fd);
+
 int
 gbm_surface_has_free_buffers(struct gbm_surface *surface);
 
+int
+gbm_surface_get_release_fd(struct gbm_surface *surface);
+
+struct gbm_bo *
+gbm_surface_try_acquire_buffer(struct gbm_surface *surface);
+
 void
 gbm_surface_destroy(struct gbm_surface *surface);
 
@@ -28,14 +28,262 @@
 #ifndef __gbm_kmsint_h__
 #define __gbm_kmsint_h__
 
-#include <libkms.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <wayland-util.h>
+#include <wayland-server.h>
 
 #include "gbmint.h"
 
+/*
+ * Destroyed BOs are kept here and handed out again to gbm_bo_create()
+ * calls asking for the same geometry, format and usage.
+ */
+struct gbm_kms_bo_cache {
+	pthread_mutex_t lock;
+	struct wl_list list;		// most recently cached first
+	unsigned int count;
+	size_t size;
+
+	unsigned int max_count;		// 0 disables the cache
+	size_t max_size;		// in bytes
+	unsigned int max_age;		// in milliseconds
+	size_t budget;			// in bytes, 0 if none has been set;
+					// arena slack and the cursor pool
+					// are not counted
+
+	uint64_t evictions;		// entries freed to stay within the limits
+};
+
+#define GBM_KMS_IMPORT_HASH_SIZE	64
+
+/*
+ * Every import of the same DMA-BUF gets the same GEM handle back from
+ * drmPrimeFDToHandle(), and so does an import of a BO we created
+ * ourselves, so handles are reference counted and closed only when the
+ * last BO using them goes away.
+ */
+struct gbm_kms_handle {
+	struct wl_list link;
+	uint32_t handle;
+	unsigned int refcount;
+};
+
+struct gbm_kms_import_bucket {
+	pthread_mutex_t lock;
+	struct wl_list list;
+};
+
+/*
+ * Handles of created and imported buffers, hashed by handle. Each bucket
+ * has its own lock.
+ *
+ * Imports hold close_lock for reading from drmPrimeFDToHandle() until
+ * they have referenced the handle, and closing a handle holds it for
+ * writing, so that no import can pick up a handle that is being closed.
+ */
+struct gbm_kms_import_table {
+	pthread_rwlock_t close_lock;
+	struct gbm_kms_import_bucket handles[GBM_KMS_IMPORT_HASH_SIZE];
+};
+
+#define GBM_KMS_CACHELINE	64
+#define GBM_KMS_SLAB_CHUNK	4096
+
+/*
+ * Fixed size objects carved out of page sized chunks, one cache line
+ * aligned slot each. Freed slots are kept on a free list until the
+ * device goes away.
+ */
+struct gbm_kms_slab {
+	pthread_mutex_t lock;
+	size_t slot_size;
+	void *free_list;		// next pointer stored in the slot
+	struct wl_list chunks;
+};
+
+#define GBM_KMS_STATS_MAX_FORMATS	32
+
+struct gbm_kms_format_stats {
+	uint32_t format;
+	uint64_t live_bos;
+	uint64_t live_bytes;
+};
+
+/*
+ * Counters reported by gbm_device_get_stats(). The live totals and the
+ * per-format table are updated under lock, the rest atomically.
+ */
+struct gbm_kms_stats {
+	pthread_mutex_t lock;
+	uint64_t live_bos;		// holding a buffer, cached ones included
+	uint64_t live_bytes;
+	int num_formats;
+	struct gbm_kms_format_stats formats[GBM_KMS_STATS_MAX_FORMATS];
+
+	uint64_t bo_created;
+	uint64_t bo_imported;
+	uint64_t bo_destroyed;
+	uint64_t prime_exports;		// drmPrimeHandleToFD() calls
+	uint64_t prime_imports;		// drmPrimeFDToHandle() calls
+	uint64_t maps;
+	uint64_t unmaps;
+	uint64_t mmaps;			// real CPU mappings set up
+	uint64_t mmaps_avoided;		// maps served by a kept mapping
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+};
+
+#define GBM_KMS_TRACK_FRAMES	16
+
+/*
+ * Where and when a BO was handed out, kept for every BO while
+ * GBM_KMS_TRACK_BOS is set. Guarded by the registry lock.
+ */
+struct gbm_kms_bo_record {
+	struct wl_list link;
+	struct gbm_kms_bo *bo;
+	uint64_t held_since;		// ms, reset when handed out again
+	bool held;			// by the user, not by a cache or pool
+	int num_frames;
+	void *frames[GBM_KMS_TRACK_FRAMES];
+};
+
+struct gbm_kms_registry {
+	bool enabled;
+	pthread_mutex_t lock;
+	struct wl_list records;
+};
+
+#define GBM_KMS_CURSOR_POOL_MAX	8
+
+/*
+ * Cursor buffers of the hardware cursor size, allocated on first use and
+ * kept mapped. The free buffer released longest ago is handed out first,
+ * so the one released last, possibly still being scanned out, is the last
+ * to be reused.
+ */
+struct gbm_kms_cursor_pool {
+	pthread_mutex_t lock;
+	uint32_t width;			// DRM_CAP_CURSOR_WIDTH
+	uint32_t height;		// DRM_CAP_CURSOR_HEIGHT
+	unsigned int count;		// 0 disables the pool
+	uint64_t releases;		// buffers given back so far
+	bool filled;
+	struct gbm_kms_bo *bo[GBM_KMS_CURSOR_POOL_MAX];
+	bool busy[GBM_KMS_CURSOR_POOL_MAX];
+	uint64_t released[GBM_KMS_CURSOR_POOL_MAX];	// value of releases then
+};
+
+#define GBM_KMS_ARENA_SIZE	(1 << 20)
+#define GBM_KMS_ARENA_GRANULE	256
+#define GBM_KMS_ARENA_GRANULES	(GBM_KMS_ARENA_SIZE / GBM_KMS_ARENA_GRANULE)
+
+/*
+ * A dumb buffer small BOs are carved out of. Each bit in used stands for
+ * one granule.
+ */
+struct gbm_kms_arena {
+	struct wl_list link;
+	struct gbm_kms_bo *bo;
+	unsigned int num_used;
+	uint64_t used[GBM_KMS_ARENA_GRANULES / 64];
+};
+
+struct gbm_kms_suballocator {
+	pthread_mutex_t lock;
+	struct wl_list arenas;
+	size_t max_size;		// largest BO to carve out, 0 disables it
+};
+
+#define GBM_KMS_UPLOAD_THREADS_MAX	8
+
+/*
+ * A write handed to the upload pool. It is queued until a thread has
+ * waited for the BO's fences, then its rows are handed out in chunks.
+ * None is started before the earlier writes to its BO are finished.
+ */
+struct gbm_kms_upload {
+	struct wl_list link;
+	struct wl_list bo_link;		// gbm_kms_bo::uploads, under the pool lock
+	struct gbm_kms_bo *bo;
+	gbm_bo_write_done_func done;
+	void *data;
+
+	uint8_t *dst;
+	const uint8_t *src;
+	uint32_t dst_stride;
+	uint32_t src_stride;
+	uint32_t src_format;		// converted to the BO's format, or 0
+	size_t row_bytes;		// when copied as is
+	uint32_t width;			// in pixels, when converted
+	uint32_t rows;
+	size_t tail;			// bytes after the last row
+
+	uint32_t chunk_rows;
+	unsigned int num_chunks;
+	unsigned int next_chunk;	// under the pool lock
+	unsigned int pending;		// chunks not copied yet
+	bool started;			// under the pool lock
+};
+
+/* Threads started on the first write that is split up */
+struct gbm_kms_upload_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list queue;
+	bool quit;
+	size_t parallel_min;		// split up synchronous writes this big
+	unsigned int max_threads;
+	unsigned int num_threads;
+	pthread_t threads[GBM_KMS_UPLOAD_THREADS_MAX];
+};
+
+/*
+ * Flushes the BO cache whenever the PSI trigger in GBM_KMS_PSI_TRIGGER,
+ * e.g. "some 150000 1000000", fires for memory.
+ */
+struct gbm_kms_pressure {
+	pthread_t thread;
+	int fd;				// /proc/pressure/memory, -1 if unused
+	int wake_fd;			// eventfd stopping the thread
+};
+
+/* A format/modifier pair scanout planes advertise through IN_FORMATS */
+struct gbm_kms_modifier {
+	uint32_t format;
+	uint64_t modifier;
+};
+
 struct gbm_kms_device {
 	struct gbm_device base;
-	struct kms_driver *kms;
+	struct gbm_kms_bo_cache cache;
+	struct gbm_kms_import_table imports;
+	struct gbm_kms_stats stats;
+	struct gbm_kms_registry registry;
+	struct gbm_kms_slab bo_slab;
+	struct gbm_kms_slab surface_slab;
+	struct gbm_kms_cursor_pool cursor;
+	struct gbm_kms_suballocator suballoc;
+	struct gbm_kms_upload_pool upload;
+	struct gbm_kms_pressure pressure;
+
+	// filled on first use by gbm_kms_query_modifiers()
+	pthread_mutex_t modifiers_lock;
+	bool modifiers_queried;
+	int num_modifiers;
+	struct gbm_kms_modifier *modifiers;
+
+	// Dumb buffers can't be created on render nodes. Those devices
+	// allocate on the primary node and import into base.fd.
+	int alloc_fd;
+
+	// BOs bound to a client's wl_buffer, see gbm_kms_import_wl_buffer()
+	struct wl_list wl_buffers;
+
+	bool persistent_map;		// keep CPU mappings of created BOs
+	int surface_buffers;		// number of buffers per surface
+	bool surface_alloc;		// surfaces allocate their own BOs
 };
 
 #define MAX_PLANES	3
@@ -45,12 +293,21 @@ struct gbm_kms_plane {
 	uint32_t stride;
 };
 
+/*
+ * Allocated from gbm_kms_device::bo_slab. The binary EGL stack inlines
+ * the helpers below, so the members up to planes keep the offsets they
+ * always had. New members go after them.
+ *
+ * Slots are cache line aligned, which puts base.handle and base.stride
+ * in the first line, but that same layout leaves num_planes and planes
+ * past it and they cannot be moved up.
+ */
 struct gbm_kms_bo {
 	struct gbm_bo base;
-	struct kms_bo *bo;
+	void *reserved;		// was the libkms BO
 	void *addr;
 	int map_ref;
-	int fd;			// FD for export
+	int fd;			// FD for export, -1 until requested
 	int locked;
 
 	uint32_t size;
@@ -60,13 +317,60 @@ struct gbm_kms_bo {
 	// for multi-planar support
 	int num_planes;
 	struct gbm_kms_plane planes[MAX_PLANES];
+
+	uint32_t offsets[MAX_PLANES];	// of each plane in the buffer
+	int plane_fds[MAX_PLANES];	// FD for export, -1 until requested
+	uint64_t modifier;
+
+	pthread_mutex_t lock;	// protects the mapping, exported FDs and fences
+	int fence;		// sync_file the producer signals, or -1
+	int release_fence;	// sync_file the consumer signals, or -1
+	size_t map_size;	// size of our own mmap() of addr
+	bool map_external;	// addr is owned by someone else
+	bool map_persistent;	// keep addr until the BO is freed
+
+	uint32_t alloc_handle;	// the dumb buffer on alloc_fd, if allocated
+	bool accounted;		// counted in the live statistics
+	bool pooled;		// owned by gbm_kms_device::cursor
+	struct gbm_kms_arena *arena;	// carved out of this at offsets[0]
+	struct gbm_kms_bo_record *record;	// NULL unless BOs are tracked
+
+	// for BO cache
+	uint32_t usage;		// GBM_BO_USE_* flags the cache matches
+	uint64_t cached_at;
+	struct wl_list cache_link;
+
+	// for BOs bound to a wl_buffer, under lock
+	unsigned int refcount;
+	bool wl_bound;
+	struct wl_listener wl_destroy;
+	struct wl_list wl_link;
+
+	// unfinished uploads in submission order, under the upload pool lock
+	struct wl_list uploads;
+};
+
+/* map_data handed out by gbm_bo_map() */
+struct gbm_kms_map {
+	struct gbm_kms_bo *bo;
+	uint32_t flags;
 };
 
+#define MAX_SURFACE_BUFFERS	4
+
+/* Allocated from gbm_kms_device::surface_slab */
 struct gbm_kms_surface {
 	struct gbm_surface base;
-	struct gbm_kms_bo *bo[2];
+	struct gbm_kms_bo *reserved[2];	// was bo[], before it could grow
 	int front;
 	int (*set_bo)(struct gbm_kms_surface *, int, void *, int, uint32_t);
+
+	// not seen by the binary EGL stack
+	struct gbm_kms_bo *bo[MAX_SURFACE_BUFFERS];
+	pthread_mutex_t lock;
+	int num_bufs;
+	int release_fd;		// eventfd, written to on release_buffer
+	bool allocated;		// bo[] are allocated by the backend
 };
 
 /* Internal API */
@@ -77,17 +381,76 @@ static inline struct gbm_kms_surface *gbm_kms_surface(struct gbm_surface *surfac
 
 static inline void gbm_kms_set_front(struct gbm_kms_surface *surface, int front)
 {
-	surface->front = front;
+	__atomic_store_n(&surface->front, front, __ATOMIC_RELEASE);
 }
 
 static inline int gbm_kms_get_front(struct gbm_kms_surface *surface)
 {
-	return surface->front;
+	return __atomic_load_n(&surface->front, __ATOMIC_ACQUIRE);
+}
+
+static inline int gbm_kms_get_num_bufs(struct gbm_kms_surface *surface)
+{
+	return surface->num_bufs;
+}
+
+/*
+ * If the surface allocated its own BOs, the GL stack renders into them
+ * instead of handing buffers in with gbm_kms_set_bo(). They stay mapped
+ * for the lifetime of the surface.
+ */
+static inline int gbm_kms_is_surface_allocated(struct gbm_kms_surface *surface)
+{
+	return surface->allocated;
+}
+
+static inline struct gbm_kms_bo *gbm_kms_get_bo(struct gbm_kms_surface *surface, int n)
+{
+	if (n < 0 || n >= surface->num_bufs)
+		return NULL;
+
+	return surface->bo[n];
+}
+
+static inline void *gbm_kms_get_bo_addr(struct gbm_kms_bo *bo)
+{
+	return bo->addr;
+}
+
+static inline int gbm_kms_get_bo_fd(struct gbm_kms_bo *bo)
+{
+	return gbm_bo_borrow_fd_for_plane(&bo->base, 0);
+}
+
+/*
+ * Make buffer n the front buffer once fence_fd signals. The fence is
+ * handed over to the BO; pass -1 if rendering is already finished.
+ */
+static inline int gbm_kms_set_front_fence(struct gbm_kms_surface *surface,
+					  int front, int fence_fd)
+{
+	struct gbm_kms_bo *bo = gbm_kms_get_bo(surface, front);
+	int ret = 0;
+
+	if (bo && fence_fd >= 0)
+		ret = gbm_bo_set_fence(&bo->base, fence_fd);
+	gbm_kms_set_front(surface, front);
+
+	return ret;
+}
+
+/*
+ * The fence to wait for before rendering into bo again, or -1. The
+ * caller owns the returned FD.
+ */
+static inline int gbm_kms_get_bo_release_fence(struct gbm_kms_bo *bo)
+{
+	return gbm_bo_get_release_fence(&bo->base);
 }
 
 static inline int gbm_kms_is_bo_locked(struct gbm_kms_bo *bo)
 {
-	return bo->locked;
+	return __atomic_load_n(&bo->locked, __ATOMIC_ACQUIRE);
 }
 
 static inline int gbm_kms_set_bo(struct gbm_kms_surface *surface, int n, void *addr, int fd, uint32_t stride)
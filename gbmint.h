@@ -43,6 +43,28 @@
  * \brief Internal implementation details of gbm
  */
 
+/**
+ * What a device node is, resolved once when the device is created. Strings
+ * are empty if they could not be found.
+ */
+struct gbm_device_identity {
+   char node[64];          /* the node the device was created with */
+   char primary_node[64];  /* /dev/dri/cardN of the same device */
+   char render_node[64];   /* /dev/dri/renderDN of the same device */
+   char driver[32];        /* kernel driver name */
+};
+
+/**
+ * What gbm_device_set_trace_callback() registered. Replaced ones are kept
+ * on the prev list until the device goes away, as a traced call may still
+ * be using them.
+ */
+struct gbm_trace_callback {
+   gbm_trace_func func;
+   void *data;
+   struct gbm_trace_callback *prev;
+};
+
 /**
  * The device used for the memory allocation.
  *
@@ -54,7 +76,7 @@ struct gbm_device {
 
    int fd;
    const char *name;
-   unsigned int refcount;
+   unsigned int refcount;      /* protected by the device list lock */
    struct stat stat;
 
    void (*destroy)(struct gbm_device *gbm);
@@ -99,6 +121,48 @@ struct gbm_device {
                                   struct gbm_bo *bo);
    int (*surface_has_free_buffers)(struct gbm_surface *surface);
    void (*surface_destroy)(struct gbm_surface *surface);
+
+   /* Everything below was added later. Members above keep their offsets
+    * so that existing backends go on working; new ones are appended. All
+    * hooks below are optional. */
+   void (*flush_cache)(struct gbm_device *gbm);
+   int (*bo_borrow_plane_fd)(struct gbm_bo *bo, int plane);
+   /* Returns non-zero if the bo is still referenced elsewhere */
+   int (*bo_unref)(struct gbm_bo *bo);
+   int (*bo_create_array)(struct gbm_device *gbm,
+                          uint32_t width, uint32_t height,
+                          uint32_t format,
+                          uint32_t usage,
+                          const uint64_t *modifiers,
+                          const unsigned int count,
+                          struct gbm_bo **bos, unsigned int num);
+   int (*get_stats)(struct gbm_device *gbm, struct gbm_device_stats *stats);
+   int (*get_format_stats)(struct gbm_device *gbm,
+                           struct gbm_format_stats *formats,
+                           unsigned int count);
+   struct {
+      int enabled;
+      struct gbm_trace_callback *callback;
+      struct gbm_latency_histogram hist[GBM_TRACE_COUNT];
+   } trace;
+   /* src_format is 0 if buf is in the format of the bo */
+   int (*bo_write_rect)(struct gbm_bo *bo, const void *buf,
+                        uint32_t src_format, uint32_t src_stride,
+                        uint32_t x, uint32_t y,
+                        uint32_t width, uint32_t height);
+   struct gbm_device_identity identity;
+   struct gbm_device *next;    /* in the list of open devices */
+   /* fences are the producer's when release is 0, the consumer's else */
+   int (*bo_set_fence)(struct gbm_bo *bo, int fence_fd, int release);
+   int (*bo_get_fence)(struct gbm_bo *bo, int release);
+   int (*surface_get_release_fd)(struct gbm_surface *surface);
+   struct gbm_bo *(*surface_try_acquire_buffer)(struct gbm_surface *surface);
+   /* done may be called before this returns */
+   int (*bo_write_async)(struct gbm_bo *bo, const void *buf, size_t count,
+                         gbm_bo_write_done_func done, void *data);
+   int (*set_memory_budget)(struct gbm_device *gbm, uint64_t bytes);
+   uint64_t (*trim_cache)(struct gbm_device *gbm, uint64_t keep);
+   int (*dump_bos)(struct gbm_device *gbm, int fd);
 };
 
 /**
@@ -134,6 +198,32 @@ struct gbm_backend {
    struct gbm_device *(*create_device)(int fd);
 };
 
+/**
+ * The memory layout of a format. Planes after the first one are
+ * subsampled by hsub and vsub.
+ */
+struct gbm_format_desc {
+   uint32_t format;
+   uint8_t num_planes;
+   uint8_t bpp;          /* of single plane formats, 0 for planar ones */
+   uint8_t cpp[3];       /* bytes per pixel of each plane */
+   uint8_t hsub;         /* horizontal chroma subsampling */
+   uint8_t vsub;         /* vertical chroma subsampling */
+};
+
+const struct gbm_format_desc *
+_gbm_format_get_desc(uint32_t format);
+
+uint32_t
+_gbm_format_get_bpp(uint32_t format);
+
+uint64_t
+_gbm_trace_begin(struct gbm_device *gbm);
+
+void
+_gbm_trace_end(struct gbm_device *gbm, enum gbm_trace_point point,
+               uint64_t start);
+
 /* The two GBM_BO_FORMAT_[XA]RGB8888 formats alias the GBM_FORMAT_*
  * formats of the same name. We want to accept them whenever someone
  * has a GBM format, but never return them to the user. */
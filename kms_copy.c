@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "gbm.h"
+#include "kms_copy.h"
+
+/*
+ * Below this, a row doesn't fill enough write-combining buffers for
+ * streaming stores to pay off.
+ */
+#define GBM_KMS_COPY_STREAM_MIN	256
+
+#if defined(__SSE2__)
+
+static void gbm_kms_copy_row_sse2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t head = -(uintptr_t)dst & 15;
+
+	// _mm_stream_si128() needs an aligned destination
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+
+	for (; n >= 64; n -= 64, src += 64, dst += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)src);
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(src + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(src + 48));
+
+		_mm_stream_si128((__m128i*)dst, a);
+		_mm_stream_si128((__m128i*)(dst + 16), b);
+		_mm_stream_si128((__m128i*)(dst + 32), c);
+		_mm_stream_si128((__m128i*)(dst + 48), d);
+	}
+
+	for (; n >= 16; n -= 16, src += 16, dst += 16)
+		_mm_stream_si128((__m128i*)dst,
+				 _mm_loadu_si128((const __m128i*)src));
+
+	memcpy(dst, src, n);
+}
+
+#if defined(__GNUC__)
+
+/*
+ * Built for AVX whatever the compiler flags say, and only called once the
+ * CPU has been found to have it.
+ */
+__attribute__((target("avx")))
+static void gbm_kms_copy_row_avx(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	size_t head = -(uintptr_t)dst & 31;
+
+	// _mm256_stream_si256() needs an aligned destination
+	memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	n -= head;
+
+	for (; n >= 128; n -= 128, src += 128, dst += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)src);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+		_mm256_stream_si256((__m256i*)dst, a);
+		_mm256_stream_si256((__m256i*)(dst + 32), b);
+		_mm256_stream_si256((__m256i*)(dst + 64), c);
+		_mm256_stream_si256((__m256i*)(dst + 96), d);
+	}
+
+	for (; n >= 32; n -= 32, src += 32, dst += 32)
+		_mm256_stream_si256((__m256i*)dst,
+				    _mm256_loadu_si256((const __m256i*)src));
+
+	memcpy(dst, src, n);
+}
+
+static void gbm_kms_copy_row(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	static int avx = -1;
+	int has_avx = __atomic_load_n(&avx, __ATOMIC_RELAXED);
+
+	// racing callers come to the same answer
+	if (has_avx < 0) {
+		has_avx = __builtin_cpu_supports("avx") ? 1 : 0;
+		__atomic_store_n(&avx, has_avx, __ATOMIC_RELAXED);
+	}
+
+	if (has_avx)
+		gbm_kms_copy_row_avx(dst, src, n);
+	else
+		gbm_kms_copy_row_sse2(dst, src, n);
+}
+
+#else
+
+static void gbm_kms_copy_row(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	gbm_kms_copy_row_sse2(dst, src, n);
+}
+
+#endif
+
+static inline void gbm_kms_copy_fence(void)
+{
+	// make the streaming stores visible before the buffer is handed on
+	_mm_sfence();
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+#if defined(__aarch64__)
+
+// STNP hints that the data is not going to be read back soon
+static inline void gbm_kms_store_pair(uint8_t *dst, uint8x16_t a,
+				      uint8x16_t b)
+{
+	__asm__ volatile("stnp %q1, %q2, [%0]"
+			 : : "r" (dst), "w" (a), "w" (b) : "memory");
+}
+
+static inline void gbm_kms_copy_fence(void)
+{
+	// STNP may be observed out of order with later stores
+	__asm__ volatile("dmb oshst" : : : "memory");
+}
+
+#else
+
+/*
+ * 32 bit ARM has no non-temporal stores, but full 64 byte bursts of
+ * consecutive stores are what lets the write buffer merge them.
+ */
+static inline void gbm_kms_store_pair(uint8_t *dst, uint8x16_t a,
+				      uint8x16_t b)
+{
+	vst1q_u8(dst, a);
+	vst1q_u8(dst + 16, b);
+}
+
+static inline void gbm_kms_copy_fence(void)
+{
+}
+
+#endif
+
+static void gbm_kms_copy_row(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	for (; n >= 64; n -= 64, src += 64, dst += 64) {
+		uint8x16_t a = vld1q_u8(src);
+		uint8x16_t b = vld1q_u8(src + 16);
+		uint8x16_t c = vld1q_u8(src + 32);
+		uint8x16_t d = vld1q_u8(src + 48);
+
+		gbm_kms_store_pair(dst, a, b);
+		gbm_kms_store_pair(dst + 32, c, d);
+	}
+
+	for (; n >= 32; n -= 32, src += 32, dst += 32)
+		gbm_kms_store_pair(dst, vld1q_u8(src), vld1q_u8(src + 16));
+
+	memcpy(dst, src, n);
+}
+
+#else
+
+static void gbm_kms_copy_row(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+static inline void gbm_kms_copy_fence(void)
+{
+}
+
+#endif
+
+void gbm_kms_copy_rect(void *_dst, uint32_t dst_stride,
+		       const void *_src, uint32_t src_stride,
+		       size_t row_bytes, uint32_t rows)
+{
+	uint8_t *dst = _dst;
+	const uint8_t *src = _src;
+	uint32_t i;
+
+	if (!rows || !row_bytes)
+		return;
+
+	// contiguous on both sides; one long row
+	if (row_bytes == dst_stride && row_bytes == src_stride) {
+		row_bytes *= rows;
+		rows = 1;
+	}
+
+	if (row_bytes < GBM_KMS_COPY_STREAM_MIN) {
+		for (i = 0; i < rows; i++)
+			memcpy(dst + (size_t)i * dst_stride,
+			       src + (size_t)i * src_stride, row_bytes);
+		return;
+	}
+
+	for (i = 0; i < rows; i++)
+		gbm_kms_copy_row(dst + (size_t)i * dst_stride,
+				 src + (size_t)i * src_stride, row_bytes);
+
+	gbm_kms_copy_fence();
+}
+
+/*
+ * The RGB formats we convert between, 8 bits per component. In memory,
+ * the little endian formats store blue first unless rgb is set.
+ */
+struct gbm_kms_rgb_format {
+	uint32_t format;
+	uint8_t cpp;
+	uint8_t rgb;		// red in the first byte
+	uint8_t alpha;		// the fourth byte is alpha, not padding
+};
+
+static const struct gbm_kms_rgb_format gbm_kms_rgb_formats[] = {
+	{ GBM_FORMAT_RGB888, 3, 0, 0 },
+	{ GBM_FORMAT_BGR888, 3, 1, 0 },
+	{ GBM_FORMAT_XRGB8888, 4, 0, 0 },
+	{ GBM_FORMAT_ARGB8888, 4, 0, 1 },
+	{ GBM_FORMAT_XBGR8888, 4, 1, 0 },
+	{ GBM_FORMAT_ABGR8888, 4, 1, 1 },
+};
+
+static const struct gbm_kms_rgb_format *gbm_kms_rgb_lookup(uint32_t format)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(gbm_kms_rgb_formats) / sizeof(gbm_kms_rgb_formats[0]); i++) {
+		if (gbm_kms_rgb_formats[i].format == format)
+			return &gbm_kms_rgb_formats[i];
+	}
+
+	return NULL;
+}
+
+int gbm_kms_can_convert(uint32_t src_format, uint32_t dst_format)
+{
+	const struct gbm_kms_rgb_format *dst;
+
+	if (src_format == dst_format)
+		return 1;
+
+	// only to 32 bit formats; nobody scans out 24 bit
+	dst = gbm_kms_rgb_lookup(dst_format);
+	return dst && dst->cpp == 4 && gbm_kms_rgb_lookup(src_format);
+}
+
+static void gbm_kms_convert_row(uint8_t *dst, const uint8_t *src,
+				uint32_t width,
+				const struct gbm_kms_rgb_format *d,
+				const struct gbm_kms_rgb_format *s)
+{
+	// padding in the source becomes opaque alpha in the destination
+	uint32_t fill = s->alpha ? 0 : 0xff000000;
+	int swap = s->rgb != d->rgb;
+	uint32_t i, p;
+
+	if (s->cpp == 4) {
+		for (i = 0; i < width; i++) {
+			memcpy(&p, src + i * 4, 4);
+			if (swap)
+				p = (p & 0xff00ff00) | ((p >> 16) & 0xff) |
+					((p & 0xff) << 16);
+			p |= fill;
+			memcpy(dst + i * 4, &p, 4);
+		}
+	} else {
+		for (i = 0; i < width; i++) {
+			const uint8_t *in = src + i * 3;
+
+			p = swap ? in[2] | in[1] << 8 | (uint32_t)in[0] << 16 :
+				in[0] | in[1] << 8 | (uint32_t)in[2] << 16;
+			p |= fill;
+			memcpy(dst + i * 4, &p, 4);
+		}
+	}
+}
+
+int gbm_kms_convert_rect(void *_dst, uint32_t dst_stride, uint32_t dst_format,
+			 const void *_src, uint32_t src_stride,
+			 uint32_t src_format, uint32_t width, uint32_t rows)
+{
+	const struct gbm_kms_rgb_format *d, *s;
+	uint8_t *dst = _dst;
+	const uint8_t *src = _src;
+	uint32_t i;
+
+	d = gbm_kms_rgb_lookup(dst_format);
+	s = gbm_kms_rgb_lookup(src_format);
+	if (!d || !s || d->cpp != 4)
+		return -1;
+
+	for (i = 0; i < rows; i++)
+		gbm_kms_convert_row(dst + (size_t)i * dst_stride,
+				    src + (size_t)i * src_stride, width, d, s);
+
+	return 0;
+}
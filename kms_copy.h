@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2013 Renesas Solutions Corp.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef __kms_copy_h__
+#define __kms_copy_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copy rows of row_bytes each from src to dst. Dumb buffers are mostly
+ * mapped write-combined, so large rows are written with non-temporal
+ * stores where the CPU has them, bypassing the cache.
+ */
+void gbm_kms_copy_rect(void *dst, uint32_t dst_stride,
+		       const void *src, uint32_t src_stride,
+		       size_t row_bytes, uint32_t rows);
+
+/*
+ * Returns non-zero if gbm_kms_convert_rect() can convert pixels from
+ * src_format to dst_format. Any format converts to itself.
+ */
+int gbm_kms_can_convert(uint32_t src_format, uint32_t dst_format);
+
+/*
+ * Like gbm_kms_copy_rect(), but for rows of width pixels, converted from
+ * src_format to dst_format on the way. Returns -1 if the formats are not
+ * RGB formats gbm_kms_can_convert() knows about; copy those instead.
+ */
+int gbm_kms_convert_rect(void *dst, uint32_t dst_stride, uint32_t dst_format,
+			 const void *src, uint32_t src_stride,
+			 uint32_t src_format, uint32_t width, uint32_t rows);
+
+#endif